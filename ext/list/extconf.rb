@@ -2,4 +2,8 @@ require 'mkmf'
 
 $CFLAGS << " -Wall"
 
+have_func('posix_memalign', 'stdlib.h')
+have_func('mkstemp', 'stdlib.h')
+have_func('rb_gc_adjust_memory_usage', 'ruby.h')
+
 create_makefile('list')
@@ -1,17 +1,53 @@
 #include "ruby.h"
 #include "ruby/encoding.h"
+#include "ruby/util.h"
+#include <math.h>
+#ifdef HAVE_MKSTEMP
+#include <unistd.h>
+#endif
 
 #define LIST_VERSION "0.2.0"
 
 VALUE cList;
+VALUE cListSorted;
 
-ID id_cmp, id_each, id_to_list;
+ID id_cmp, id_eq, id_each, id_to_list, id_call, id_next, id_size, id_lazy, id_uniq;
+ID id_memory_limit, id_tmpdir, id_eqq, id_to_s, id_write;
 
 typedef struct item_t {
 	VALUE value;
 	struct item_t *next;
 } item_t;
 
+/* source of items which are not materialized yet */
+typedef struct {
+	VALUE gen;      /* Proc called with index, or Enumerator */
+	long pos;       /* count of items already produced */
+	long len;       /* declared length, or -1 when unknown */
+	int enumerator;
+	int busy;
+} list_lazy_t;
+
+/* len of a source whose size is Infinity */
+#define LAZY_LEN_INFINITE (-2)
+
+/* express lanes of List::Sorted over the chain, which serves as lane -1 */
+typedef struct skip_node {
+	item_t *item;	/* NULL for the head */
+	struct skip_lane {
+		struct skip_node *next;
+		long span;	/* count of items from this node to next */
+	} lane[1];
+} skip_node_t;
+
+#define SKIP_MAX_LEVEL 32
+
+typedef struct {
+	skip_node_t *head;
+	int level;
+	unsigned long serial;	/* changes on every add and delete */
+} skip_index_t;
+
 typedef struct {
 	item_t *first;
 	item_t *last;
@@ -19,6 +55,9 @@ typedef struct {
 		long len;
 		VALUE shared;
 	} aux;
+	list_lazy_t *lazy;
+	skip_index_t *skip;	/* built on demand, dropped on modification */
+	st_index_t hash;	/* cached once frozen, 0 when unknown */
 } list_t;
 
 static VALUE list_push_ary(VALUE, VALUE);
@@ -26,15 +65,24 @@ static VALUE list_push(VALUE, VALUE);
 static VALUE list_unshift(VALUE, VALUE);
 static VALUE list_replace(VALUE, VALUE);
 static VALUE list_length(VALUE);
+static VALUE list_dup(VALUE);
+static VALUE list_make_shared_copy(VALUE);
+static void list_lazy_fill(VALUE, long);
+static st_index_t vset_hash(VALUE);
+static inline int vset_eql(VALUE, VALUE);
 
 #define DEBUG 0
 
 #define LIST_MAX_SIZE ULONG_MAX
-#define LIST_PTR(list) ((list_t*)DATA_PTR(list))
+#define LIST_RAW_PTR(list) ((list_t*)DATA_PTR(list))
+#define LIST_PTR(list) list_ptr(list)
 #define LIST_PTR_LEN(ptr) (ptr)->aux.len
 #define LIST_LEN(list) LIST_PTR(list)->aux.len
+#define LIST_LAZY_P(list) (LIST_RAW_PTR(list)->lazy != NULL)
 
 #define LIST_FOR(self, c) for (c = LIST_PTR(self)->first; c; c = (c)->next)
+/* materialize lazy items only as far as the loop reaches */
+#define LIST_FOR_LAZY(self, c) for (c = list_lazy_first(self); c; c = list_lazy_next(self, c))
 
 #define LIST_FOR_DOUBLE(l1, c1, l2, c2, code) do { \
 	c1 = LIST_PTR(l1)->first; \
@@ -50,6 +98,33 @@ static VALUE list_length(VALUE);
 #  define FALSE 0
 #endif
 
+/* all items are materialized before anyone touches the chain */
+static inline list_t *
+list_ptr(VALUE self)
+{
+	list_t *ptr = LIST_RAW_PTR(self);
+	if (ptr->lazy) list_lazy_fill(self, -1);
+	return ptr;
+}
+
+static inline item_t *
+list_lazy_first(VALUE self)
+{
+	list_t *ptr = LIST_RAW_PTR(self);
+	if (ptr->first == NULL && ptr->lazy) list_lazy_fill(self, 1);
+	return ptr->first;
+}
+
+static inline item_t *
+list_lazy_next(VALUE self, item_t *c)
+{
+	list_t *ptr = LIST_RAW_PTR(self);
+	if (c->next == NULL && ptr->lazy && c == ptr->last) {
+		list_lazy_fill(self, LIST_PTR_LEN(ptr) + 1);
+	}
+	return c->next;
+}
+
 #ifndef TRUE
 #  define TRUE 1
 #endif
@@ -57,7 +132,7 @@ static VALUE list_length(VALUE);
 static VALUE
 list_enum_length(VALUE self, VALUE args, VALUE eobj)
 {
-	return LONG2NUM(LIST_LEN(self));
+	return list_length(self);
 }
 static VALUE
 list_cycle_size(VALUE self, VALUE args, VALUE eobj)
@@ -75,6 +150,19 @@ list_cycle_size(VALUE self, VALUE args, VALUE eobj)
 	return rb_funcall(list_length(self), '*', 1, LONG2FIX(mul));
 }
 
+#ifndef RB_FLOAT_TYPE_P
+#  define RB_FLOAT_TYPE_P(v) (TYPE(v) == T_FLOAT)
+#endif
+#ifndef RARRAY_CONST_PTR
+#  define RARRAY_CONST_PTR(a) ((const VALUE *)RARRAY_PTR(a))
+#endif
+#ifndef RARRAY_PTR_USE
+#  define RARRAY_PTR_USE(ary, ptr_name, expr) do { \
+	VALUE *ptr_name = RARRAY_PTR(ary); \
+	expr; \
+} while (0)
+#endif
+
 /* from intern.h */
 #ifndef RBASIC_CLEAR_CLASS
 #  define RBASIC_CLEAR_CLASS(obj) (((struct RBasicRaw *)((VALUE)(obj)))->klass = 0)
@@ -135,30 +223,285 @@ check(list_t *ptr, const char *msg)
 }
 #endif
 
+/*
+ * Items are carved out of aligned blocks, so that a chain of k items
+ * costs one malloc per block instead of k mallocs, and a freed item
+ * finds its block by masking its address.
+ */
+#define ITEM_BLOCK_SIZE (16 * 1024)
+#define ITEM_BLOCK_OF(c) ((item_block_t *)((uintptr_t)(c) & ~(uintptr_t)(ITEM_BLOCK_SIZE - 1)))
+#define ITEM_BLOCK_ITEMS ((long)((ITEM_BLOCK_SIZE - sizeof(item_block_t)) / sizeof(item_t)))
+#define ITEM_BLOCK_HEAD(b) ((item_t *)((b) + 1))
+
+typedef struct item_block_t {
+	struct item_block_t *prev;  /* blocks which have room for items */
+	struct item_block_t *next;
+	item_t *free;
+	long carved;
+	long used;
+	void *raw;
+} item_block_t;
+
+static item_block_t *item_blocks;
+static int item_empty_blocks;
+
+static void
+item_block_link(item_block_t *b)
+{
+	b->prev = NULL;
+	b->next = item_blocks;
+	if (item_blocks) item_blocks->prev = b;
+	item_blocks = b;
+}
+
+static void
+item_block_unlink(item_block_t *b)
+{
+	if (b->prev) b->prev->next = b->next;
+	else item_blocks = b->next;
+	if (b->next) b->next->prev = b->prev;
+	b->prev = b->next = NULL;
+}
+
+static item_block_t *
+item_block_new(void)
+{
+	item_block_t *b;
+	void *raw;
+
+#ifdef HAVE_POSIX_MEMALIGN
+	if (posix_memalign(&raw, ITEM_BLOCK_SIZE, ITEM_BLOCK_SIZE) != 0) {
+		rb_gc();
+		if (posix_memalign(&raw, ITEM_BLOCK_SIZE, ITEM_BLOCK_SIZE) != 0) {
+			rb_memerror();
+		}
+	}
+	b = (item_block_t *)raw;
+#else
+	raw = xmalloc(ITEM_BLOCK_SIZE * 2);
+	b = (item_block_t *)(((uintptr_t)raw + ITEM_BLOCK_SIZE - 1) & ~(uintptr_t)(ITEM_BLOCK_SIZE - 1));
+#endif
+#ifdef HAVE_RB_GC_ADJUST_MEMORY_USAGE
+	rb_gc_adjust_memory_usage(ITEM_BLOCK_SIZE);
+#endif
+	b->raw = raw;
+	b->free = NULL;
+	b->carved = 0;
+	b->used = 0;
+	item_block_link(b);
+	item_empty_blocks++;
+	return b;
+}
+
+static void
+item_block_release(item_block_t *b)
+{
+	item_block_unlink(b);
+	item_empty_blocks--;
+#ifdef HAVE_RB_GC_ADJUST_MEMORY_USAGE
+	rb_gc_adjust_memory_usage(-ITEM_BLOCK_SIZE);
+#endif
+#ifdef HAVE_POSIX_MEMALIGN
+	free(b->raw);
+#else
+	xfree(b->raw);
+#endif
+}
+
+static inline item_t *
+item_take(item_block_t *b)
+{
+	item_t *c;
+
+	if (b->used++ == 0) item_empty_blocks--;
+	if (b->free) {
+		c = b->free;
+		b->free = c->next;
+	} else {
+		c = ITEM_BLOCK_HEAD(b) + b->carved++;
+	}
+	if (b->free == NULL && b->carved == ITEM_BLOCK_ITEMS) {
+		item_block_unlink(b);
+	}
+	return c;
+}
+
+static item_t *
+item_alloc(VALUE obj, item_t *next)
+{
+	item_t *item;
+
+	item = item_take(item_blocks ? item_blocks : item_block_new());
+	item->value = obj;
+	item->next = next;
+	return item;
+}
+
+/* chain of n items linked from first to *lastp, values are left unset */
+static item_t *
+item_alloc_chain(long n, item_t **lastp)
+{
+	item_block_t *b;
+	item_t *first = NULL, *last = NULL, *c;
+	long i, k;
+
+	while (0 < n) {
+		b = item_blocks ? item_blocks : item_block_new();
+		if (b->free == NULL) {
+			/* carve a run of adjacent items at once */
+			k = ITEM_BLOCK_ITEMS - b->carved;
+			if (n < k) k = n;
+			if (b->used == 0) item_empty_blocks--;
+			c = ITEM_BLOCK_HEAD(b) + b->carved;
+			for (i = 0; i < k - 1; i++) {
+				c[i].next = &c[i + 1];
+			}
+			b->carved += k;
+			b->used += k;
+			if (b->carved == ITEM_BLOCK_ITEMS) {
+				item_block_unlink(b);
+			}
+			if (last) last->next = c;
+			else first = c;
+			last = &c[k - 1];
+			n -= k;
+		} else {
+			c = item_take(b);
+			if (last) last->next = c;
+			else first = c;
+			last = c;
+			n--;
+		}
+	}
+	if (last) last->next = NULL;
+	*lastp = last;
+	return first;
+}
+
+static void
+item_free(item_t *c)
+{
+	item_block_t *b = ITEM_BLOCK_OF(c);
+
+	if (b->free == NULL && b->carved == ITEM_BLOCK_ITEMS) {
+		item_block_link(b);
+	}
+	c->next = b->free;
+	b->free = c;
+	if (--b->used == 0) {
+		item_empty_blocks++;
+		/* keep one empty block around for the next allocation */
+		if (1 < item_empty_blocks) {
+			item_block_release(b);
+		}
+	}
+}
+
 static inline VALUE
 list_new(void)
 {
 	return rb_obj_alloc(cList);
 }
 
+static void list_push_item(VALUE, VALUE);
+static VALUE list_lazy_init(VALUE, VALUE, long, int);
+static int list_push_range(VALUE, VALUE);
+static void list_push_ary_batched(VALUE, VALUE);
+static void list_push_hash(VALUE, VALUE);
+static void list_push_struct(VALUE, VALUE);
+
+/* bulk conversions check for interrupts once per this many items */
+#define TO_LIST_BATCH 0x400
+
 static VALUE
 collect_all(VALUE i, VALUE list, int argc, VALUE *argv)
 {
 	VALUE pack;
-	rb_thread_check_ints();
+	if ((LIST_RAW_PTR(list)->aux.len & (TO_LIST_BATCH - 1)) == 0) {
+		rb_thread_check_ints();
+	}
 	if (argc == 0) pack = Qnil;
 	else if (argc == 1) pack = argv[0];
 	else pack = rb_ary_new4(argc, argv);
 
-	list_push(list, pack);
+	list_push_item(list, pack);
 	return Qnil;
 }
 
+/* whether each of obj is the builtin one of klass */
+static inline int
+basic_each_p(VALUE obj, VALUE klass)
+{
+	return rb_obj_is_kind_of(obj, klass) &&
+		rb_method_basic_definition_p(CLASS_OF(obj), id_each);
+}
+
+/* size is the number of items each yields, now and later */
+static inline int
+exact_size_p(VALUE obj)
+{
+	return basic_each_p(obj, rb_cRange) || basic_each_p(obj, rb_cStruct) ||
+		(OBJ_FROZEN(obj) && (basic_each_p(obj, rb_cArray) || basic_each_p(obj, rb_cHash)));
+}
+
+/* lazy->len for a size hint */
+static long
+lazy_len_of_size(VALUE size)
+{
+	if (FIXNUM_P(size)) return FIX2LONG(size);
+	if (RB_FLOAT_TYPE_P(size) && isinf(RFLOAT_VALUE(size)) && 0 < RFLOAT_VALUE(size)) {
+		return LAZY_LEN_INFINITE;
+	}
+	return -1;
+}
+
 static VALUE
 ary_to_list(int argc, VALUE *argv, VALUE obj)
 {
 	VALUE list = list_new();
-	rb_block_call(obj, id_each, argc, argv, collect_all, list);
+	VALUE args, opts, gen, size;
+
+	if (argc == 0) {
+		switch (rb_type(obj)) {
+		case T_ARRAY:
+			if (!basic_each_p(obj, rb_cArray)) break;
+			list_push_ary_batched(list, obj);
+			return list;
+		case T_HASH:
+			if (!basic_each_p(obj, rb_cHash)) break;
+			list_push_hash(list, obj);
+			return list;
+		case T_STRUCT:
+			if (basic_each_p(obj, rb_cStruct)) {
+				list_push_struct(list, obj);
+				return list;
+			}
+			/* fall through, a Range is a T_STRUCT too */
+		default:
+			if (basic_each_p(obj, rb_cRange) && list_push_range(list, obj)) {
+				return list;
+			}
+			break;
+		}
+	}
+
+	rb_scan_args(argc, argv, "*:", &args, &opts);
+	if (!NIL_P(opts) && RTEST(rb_hash_aref(opts, ID2SYM(id_lazy)))) {
+		size = Qnil;
+		if (RARRAY_LEN(args) == 0) {
+			if (basic_each_p(obj, rb_cArray) && !OBJ_FROZEN(obj)) {
+				/* a shared frozen copy, so that later changes to obj can't break the size */
+				obj = rb_obj_freeze(rb_ary_subseq(obj, 0, RARRAY_LEN(obj)));
+			}
+			/* Enumerator#size and the like are only hints */
+			if (exact_size_p(obj)) {
+				size = rb_funcall(obj, id_size, 0);
+			}
+		}
+		gen = rb_enumeratorize(obj, ID2SYM(id_each), RARRAY_LENINT(args), RARRAY_PTR(args));
+		return list_lazy_init(list, gen, lazy_len_of_size(size), TRUE);
+	}
+	rb_block_call(obj, id_each, RARRAY_LENINT(args), RARRAY_PTR(args), collect_all, list);
 	OBJ_INFECT(list, obj);
 	return list;
 }
@@ -170,23 +513,109 @@ to_list(VALUE obj)
 
 	switch (rb_type(obj)) {
 	case T_DATA:
-		return obj;
+		if (rb_obj_is_kind_of(obj, cList)) return obj;
+		/* other data objects are never read as a list_t */
+		if (!rb_respond_to(obj, id_to_list)) {
+			rb_raise(rb_eTypeError, "can't convert %"PRIsVALUE" into List",
+				 rb_obj_class(obj));
+		}
+		break;
 	case T_ARRAY:
 		return ary_to_list(0, NULL, obj);
 	default:
-		if (rb_respond_to(obj, id_to_list)) {
-			return rb_funcall(obj, id_to_list, 0);
+		if (!rb_respond_to(obj, id_to_list)) {
+			list = list_new();
+			return list_push(list, obj);
 		}
 	}
 
-	list = list_new();
-	return list_push(list, obj);
+	list = rb_funcall(obj, id_to_list, 0);
+	if (!rb_obj_is_kind_of(list, cList)) {
+		rb_raise(rb_eTypeError, "can't convert %"PRIsVALUE" to List (%"PRIsVALUE"#to_list gives %"PRIsVALUE")",
+			 rb_obj_class(obj), rb_obj_class(obj), rb_obj_class(list));
+	}
+	return list;
 }
 
+static void skip_index_free(list_t *);
+
 static inline void
 list_modify_check(VALUE self)
 {
 	rb_check_frozen(self);
+	if (LIST_LAZY_P(self)) list_lazy_fill(self, -1);
+	if (LIST_RAW_PTR(self)->skip) skip_index_free(LIST_RAW_PTR(self));
+}
+
+/* <=> and == without method calls while the builtin ones are in use */
+struct cmp_opt {
+	unsigned int inited;
+	unsigned int basic;
+};
+
+#define CMP_OPT_INIT {0, 0}
+#define CMP_OPT_INTEGER 0x01
+#define CMP_OPT_FLOAT   0x02
+#define CMP_OPT_STRING  0x04
+#define CMP_OPT_SYMBOL  0x08
+
+#define STRING_P(v) (RB_TYPE_P((v), T_STRING) && RBASIC_CLASS(v) == rb_cString)
+
+static inline int
+cmp_opt_basic_p(struct cmp_opt *opt, unsigned int bit, VALUE klass, ID id)
+{
+	if (!(opt->inited & bit)) {
+		opt->inited |= bit;
+		if (rb_method_basic_definition_p(klass, id)) {
+			opt->basic |= bit;
+		}
+	}
+	return opt->basic & bit;
+}
+
+/* FALSE when a <=> b has to be called */
+static inline int
+optimized_cmp(struct cmp_opt *opt, VALUE a, VALUE b, int *result)
+{
+	if (FIXNUM_P(a) && FIXNUM_P(b)) {
+		if (!cmp_opt_basic_p(opt, CMP_OPT_INTEGER, CLASS_OF(a), id_cmp)) return FALSE;
+		*result = ((long)a > (long)b) - ((long)a < (long)b);
+		return TRUE;
+	}
+	if (RB_FLOAT_TYPE_P(a) && RB_FLOAT_TYPE_P(b)) {
+		double x = RFLOAT_VALUE(a), y = RFLOAT_VALUE(b);
+
+		if (isnan(x) || isnan(y)) return FALSE;
+		if (!cmp_opt_basic_p(opt, CMP_OPT_FLOAT, CLASS_OF(a), id_cmp)) return FALSE;
+		*result = (x > y) - (x < y);
+		return TRUE;
+	}
+	if (STRING_P(a) && STRING_P(b)) {
+		if (!cmp_opt_basic_p(opt, CMP_OPT_STRING, rb_cString, id_cmp)) return FALSE;
+		*result = rb_str_cmp(a, b);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+static inline int
+optimized_equal(struct cmp_opt *opt, VALUE a, VALUE b)
+{
+	if (a == b) return TRUE;
+	if (FIXNUM_P(a) && FIXNUM_P(b)) {
+		if (cmp_opt_basic_p(opt, CMP_OPT_INTEGER, CLASS_OF(a), id_eq)) return FALSE;
+	} else if (RB_FLOAT_TYPE_P(a) && RB_FLOAT_TYPE_P(b)) {
+		if (cmp_opt_basic_p(opt, CMP_OPT_FLOAT, CLASS_OF(a), id_eq)) {
+			return RFLOAT_VALUE(a) == RFLOAT_VALUE(b);
+		}
+	} else if (STRING_P(a) && STRING_P(b)) {
+		if (cmp_opt_basic_p(opt, CMP_OPT_STRING, rb_cString, id_eq)) {
+			return RTEST(rb_str_equal(a, b));
+		}
+	} else if (SYMBOL_P(a) && SYMBOL_P(b)) {
+		if (cmp_opt_basic_p(opt, CMP_OPT_SYMBOL, rb_cSymbol, id_eq)) return FALSE;
+	}
+	return RTEST(rb_equal(a, b));
 }
 
 static void
@@ -195,6 +624,7 @@ list_mark(list_t *ptr)
 	item_t *c;
 	item_t *end;
 
+	if (ptr->lazy) rb_gc_mark(ptr->lazy->gen);
 	if (ptr->first == NULL) return;
 	end = ptr->last->next;
 	rb_gc_mark(ptr->first->value);
@@ -211,17 +641,29 @@ list_free(list_t *ptr)
 	item_t *next;
 	item_t *end;
 
+	if (ptr->lazy) {
+		xfree(ptr->lazy);
+		ptr->lazy = NULL;
+	}
+	if (ptr->skip) skip_index_free(ptr);
 	if (ptr->first == NULL) return;
 	first_next = ptr->first->next;
 	end = ptr->last->next;
-	xfree(ptr->first);
+	item_free(ptr->first);
 	for (c = first_next; c != end;) {
 		next = c->next;
-		xfree(c);
+		item_free(c);
 		c = next;
 	}
 }
 
+static void
+list_dealloc(list_t *ptr)
+{
+	list_free(ptr);
+	xfree(ptr);
+}
+
 static void
 list_mem_clear(VALUE self, long beg, long len)
 {
@@ -246,7 +688,7 @@ list_mem_clear(VALUE self, long beg, long len)
 			i++;
 			if (i < len) { // mid
 				next = c->next;
-				xfree(c);
+				item_free(c);
 				c = next;
 			}
 			if (len == i) { // end
@@ -261,7 +703,7 @@ list_mem_clear(VALUE self, long beg, long len)
 			if (beg - 1 == i) { // begin
 				last = c;
 			} else if (beg <= i) { // mid
-				xfree(c);
+				item_free(c);
 			}
 			c = next;
 		}
@@ -279,7 +721,7 @@ list_mem_clear(VALUE self, long beg, long len)
 			}
 			if (beg <= i) { // mid
 				next = c->next;
-				xfree(c);
+				item_free(c);
 				c = next;
 			}
 		}
@@ -295,6 +737,9 @@ list_new_ptr(void)
 	ptr->first = NULL;
 	ptr->last = ptr->first;
 	LIST_PTR_LEN(ptr) = 0;
+	ptr->lazy = NULL;
+	ptr->skip = NULL;
+	ptr->hash = 0;
 	return ptr;
 }
 
@@ -302,17 +747,181 @@ static VALUE
 list_alloc(VALUE self)
 {
 	list_t *ptr = list_new_ptr();
-	return Data_Wrap_Struct(self, list_mark, list_free, ptr);
+	return Data_Wrap_Struct(self, list_mark, list_dealloc, ptr);
+}
+
+/* unlink c, which follows before, and free it */
+static inline void
+list_unlink(list_t *ptr, item_t *before, item_t *c)
+{
+	if (before) {
+		before->next = c->next;
+	} else {
+		ptr->first = c->next;
+	}
+	if (ptr->last == c) {
+		ptr->last = before;
+	}
+	item_free(c);
+	LIST_PTR_LEN(ptr)--;
+}
+
+/* link a detached chain of n items to the tail at once */
+static inline void
+list_attach(list_t *ptr, item_t *first, item_t *last, long n)
+{
+	if (n == 0) return;
+	if (ptr->first == NULL) {
+		ptr->first = first;
+	} else {
+		ptr->last->next = first;
+	}
+	ptr->last = last;
+	LIST_PTR_LEN(ptr) += n;
+}
+
+static inline void
+list_recursive_check(VALUE self, long n, const VALUE *values)
+{
+	long i;
+
+	for (i = 0; i < n; i++) {
+		if (values[i] == self) {
+			rb_raise(rb_eArgError, "`List' cannot set recursive");
+		}
+	}
 }
 
+/* detached chain holding the first n values of Array or List src */
 static item_t *
-item_alloc(VALUE obj, item_t *next)
+item_chain_copy(VALUE src, long n, item_t **lastp)
 {
-	item_t *item;
-	item = xmalloc(sizeof(item_t));
-	item->value = obj;
-	item->next = next;
-	return item;
+	item_t *first, *c, *s;
+	const VALUE *p;
+
+	first = item_alloc_chain(n, lastp);
+	if (TYPE(src) == T_ARRAY) {
+		p = RARRAY_CONST_PTR(src);
+		for (c = first; c; c = c->next) {
+			c->value = *p++;
+		}
+	} else {
+		s = LIST_PTR(src)->first;
+		for (c = first; c; c = c->next) {
+			c->value = s->value;
+			s = s->next;
+		}
+	}
+	return first;
+}
+
+static VALUE
+list_push_values(VALUE self, long n, const VALUE *values)
+{
+	item_t *first, *last, *c;
+
+	list_recursive_check(self, n, values);
+	if (n == 0) return self;
+	first = item_alloc_chain(n, &last);
+	for (c = first; c; c = c->next) {
+		c->value = *values++;
+	}
+	list_attach(LIST_PTR(self), first, last, n);
+	return self;
+}
+
+static VALUE
+list_push_fill(VALUE self, long n, VALUE val)
+{
+	item_t *first, *last, *c;
+
+	if (n <= 0) return self;
+	list_recursive_check(self, 1, &val);
+	first = item_alloc_chain(n, &last);
+	for (c = first; c; c = c->next) {
+		c->value = val;
+	}
+	list_attach(LIST_PTR(self), first, last, n);
+	return self;
+}
+
+/* append without the checks of List#push, for freshly built lists */
+static void
+list_push_item(VALUE self, VALUE obj)
+{
+	item_t *c = item_alloc(obj, NULL);
+	list_attach(LIST_RAW_PTR(self), c, c, 1);
+}
+
+static int
+list_push_range(VALUE self, VALUE range)
+{
+	VALUE b, e;
+	int excl;
+	long beg, n, k;
+	item_t *first, *last, *c;
+
+	if (!rb_range_values(range, &b, &e, &excl)) return FALSE;
+	if (!FIXNUM_P(b) || !FIXNUM_P(e)) return FALSE;
+	beg = FIX2LONG(b);
+	n = FIX2LONG(e) - beg + (excl ? 0 : 1);
+	if (n <= 0) return TRUE;
+	if (LONG_MAX / (long)sizeof(item_t) < n) {
+		rb_raise(rb_eArgError, "range too big");
+	}
+	while (0 < n) {
+		k = n < TO_LIST_BATCH ? n : TO_LIST_BATCH;
+		first = item_alloc_chain(k, &last);
+		for (c = first; c; c = c->next) {
+			c->value = LONG2FIX(beg);
+			beg++;
+		}
+		list_attach(LIST_RAW_PTR(self), first, last, k);
+		n -= k;
+		if (n) rb_thread_check_ints();
+	}
+	return TRUE;
+}
+
+/* copy an Array a batch at a time, rereading it after each interrupt
+ * check since a trap handler may change it */
+static void
+list_push_ary_batched(VALUE self, VALUE ary)
+{
+	long i, k;
+
+	for (i = 0; i < RARRAY_LEN(ary); i += k) {
+		if (i) rb_thread_check_ints();
+		k = RARRAY_LEN(ary) - i;
+		if (TO_LIST_BATCH < k) k = TO_LIST_BATCH;
+		list_push_values(self, k, RARRAY_CONST_PTR(ary) + i);
+	}
+}
+
+static int
+hash_to_list_i(VALUE key, VALUE value, VALUE list)
+{
+	if ((LIST_RAW_PTR(list)->aux.len & (TO_LIST_BATCH - 1)) == 0) {
+		rb_thread_check_ints();
+	}
+	list_push_item(list, rb_assoc_new(key, value));
+	return ST_CONTINUE;
+}
+
+static void
+list_push_hash(VALUE self, VALUE hash)
+{
+	rb_hash_foreach(hash, hash_to_list_i, self);
+}
+
+static void
+list_push_struct(VALUE self, VALUE st)
+{
+	long i, n = RSTRUCT_LEN(st);
+
+	for (i = 0; i < n; i++) {
+		list_push_item(self, rb_struct_aref(st, LONG2FIX(i)));
+	}
 }
 
 static VALUE
@@ -342,58 +951,155 @@ list_push(VALUE self, VALUE obj)
 }
 
 static VALUE
-list_push_ary(VALUE self, VALUE ary)
+lazy_gen_call(VALUE arg)
 {
-	long i;
+	list_lazy_t *lazy = (list_lazy_t *)arg;
 
-	list_modify_check(self);
-	for (i = 0; i < RARRAY_LEN(ary); i++) {
-		list_push(self, rb_ary_entry(ary, i));
+	if (lazy->enumerator) {
+		return rb_funcall(lazy->gen, id_next, 0);
 	}
-	return self;
+	return rb_funcall(lazy->gen, id_call, 1, LONG2NUM(lazy->pos));
 }
 
 static VALUE
-list_push_m(int argc, VALUE *argv, VALUE self)
+lazy_gen_stop(VALUE arg, VALUE err)
 {
-	long i;
-
-	list_modify_check(self);
-	if (argc == 0) return self;
-	for (i = 0; i < argc; i++) {
-		list_push(self, argv[i]);
-	}
-	return self;
+	return Qundef;
 }
 
 static VALUE
-list_s_create(int argc, VALUE *argv, VALUE klass)
+lazy_gen_next(VALUE arg)
 {
-	VALUE list;
-
-	list = rb_obj_alloc(klass);
-	return list_push_m(argc, argv, list);
+	return rb_rescue2(lazy_gen_call, arg, lazy_gen_stop, arg, rb_eStopIteration, (VALUE)0);
 }
 
 static VALUE
-check_list_type(VALUE obj)
+lazy_gen_done(VALUE arg)
 {
-	if (TYPE(obj) == T_DATA) return obj;
-	return rb_check_convert_type(obj, T_DATA, "List", "to_list");
+	((list_lazy_t *)arg)->busy = FALSE;
+	return Qnil;
 }
 
-static VALUE
-list_s_try_convert(VALUE dummy, VALUE obj)
+/* materialize items until the chain holds n of them (n < 0 means all) */
+static void
+list_lazy_fill(VALUE self, long n)
 {
-	return check_list_type(obj);
+	list_t *ptr = LIST_RAW_PTR(self);
+	list_lazy_t *lazy = ptr->lazy;
+	item_t *c;
+	VALUE v;
+
+	if (lazy->busy) {
+		rb_raise(rb_eRuntimeError, "lazy list accessed from its own generator");
+	}
+	if (n < 0 && lazy->len == LAZY_LEN_INFINITE) {
+		rb_raise(rb_eRangeError, "cannot materialize an infinite List");
+	}
+	while (n < 0 || LIST_PTR_LEN(ptr) < n) {
+		if (0 <= lazy->len && lazy->len <= lazy->pos) break;
+		lazy->busy = TRUE;
+		v = rb_ensure(lazy_gen_next, (VALUE)lazy, lazy_gen_done, (VALUE)lazy);
+		if (v == Qundef) break;
+		if (v == self) {
+			rb_raise(rb_eArgError, "`List' cannot set recursive");
+		}
+		c = item_alloc(v, NULL);
+		if (ptr->first == NULL) {
+			ptr->first = c;
+		} else {
+			ptr->last->next = c;
+		}
+		ptr->last = c;
+		LIST_PTR_LEN(ptr)++;
+		lazy->pos++;
+	}
+	if (n < 0 || LIST_PTR_LEN(ptr) < n || (0 <= lazy->len && lazy->len <= lazy->pos)) {
+		ptr->lazy = NULL;
+		xfree(lazy);
+	}
 }
 
 static VALUE
-list_initialize(int argc, VALUE *argv, VALUE self)
+list_lazy_init(VALUE self, VALUE gen, long len, int enumerator)
+{
+	list_t *ptr = LIST_RAW_PTR(self);
+	list_lazy_t *lazy;
+
+	if (len == 0) return self;
+	lazy = ALLOC(list_lazy_t);
+	lazy->gen = gen;
+	lazy->pos = 0;
+	lazy->len = len;
+	lazy->enumerator = enumerator;
+	lazy->busy = FALSE;
+	ptr->lazy = lazy;
+	return self;
+}
+
+static VALUE
+list_s_lazy_new(VALUE klass, VALUE size)
+{
+	long len;
+
+	rb_need_block();
+	len = NUM2LONG(size);
+	if (len < 0) {
+		rb_raise(rb_eArgError, "negative size");
+	}
+	return list_lazy_init(rb_obj_alloc(klass), rb_block_proc(), len, FALSE);
+}
+
+static VALUE
+list_push_ary(VALUE self, VALUE ary)
+{
+	item_t *first, *last;
+	long n;
+
+	list_modify_check(self);
+	n = RARRAY_LEN(ary);
+	if (n == 0) return self;
+	list_recursive_check(self, n, RARRAY_CONST_PTR(ary));
+	first = item_chain_copy(ary, n, &last);
+	list_attach(LIST_PTR(self), first, last, n);
+	return self;
+}
+
+static VALUE
+list_push_m(int argc, VALUE *argv, VALUE self)
+{
+	list_modify_check(self);
+	return list_push_values(self, argc, argv);
+}
+
+static VALUE
+list_s_create(int argc, VALUE *argv, VALUE klass)
+{
+	VALUE list;
+
+	list = rb_obj_alloc(klass);
+	return list_push_values(list, argc, argv);
+}
+
+static VALUE
+check_list_type(VALUE obj)
+{
+	if (TYPE(obj) == T_DATA) return obj;
+	return rb_check_convert_type(obj, T_DATA, "List", "to_list");
+}
+
+static VALUE
+list_s_try_convert(VALUE dummy, VALUE obj)
+{
+	return check_list_type(obj);
+}
+
+static VALUE
+list_initialize(int argc, VALUE *argv, VALUE self)
 {
-	VALUE size, val;
+	VALUE size, val, v;
 	long len;
 	long i;
+	item_t *c;
 
 	list_modify_check(self);
 	if (argc == 0) {
@@ -425,12 +1131,13 @@ list_initialize(int argc, VALUE *argv, VALUE self)
 			rb_warn("block supersedes default value argument");
 		}
 		for (i = 0; i < len; i++) {
-			list_push(self, rb_yield(LONG2NUM(i)));
+			v = rb_yield(LONG2NUM(i));
+			list_recursive_check(self, 1, &v);
+			c = item_alloc(v, NULL);
+			list_attach(LIST_PTR(self), c, c, 1);
 		}
 	} else {
-		for (i = 0; i < len; i++) {
-			list_push(self, val);
-		}
+		list_push_fill(self, len, val);
 	}
 	return self;
 }
@@ -442,7 +1149,7 @@ list_each(VALUE self)
 
 	RETURN_SIZED_ENUMERATOR(self, 0, 0, list_enum_length);
 
-	LIST_FOR(self, c) {
+	LIST_FOR_LAZY(self, c) {
 		rb_yield(c->value);
 	}
 	return self;
@@ -466,8 +1173,9 @@ list_each_index(VALUE self)
 static VALUE
 list_clear(VALUE self)
 {
-	list_modify_check(self);
 	list_t *ptr;
+
+	rb_check_frozen(self);
 	Data_Get_Struct(self, list_t, ptr);
 	list_free(ptr);
 	ptr->first = NULL;
@@ -497,9 +1205,7 @@ list_replace_ary(VALUE copy, VALUE orig)
 		}
 	} else {
 		list_clear(copy);
-		for (i = 0; i < olen; i++) {
-			list_push(copy, rb_ary_entry(orig, i));
-		}
+		list_push_ary(copy, orig);
 	}
 	return copy;
 }
@@ -509,6 +1215,7 @@ list_replace(VALUE copy, VALUE orig)
 {
 	item_t *c_orig;
 	item_t *c_copy;
+	item_t *first, *last;
 	long olen;
 
 	list_modify_check(copy);
@@ -533,9 +1240,8 @@ list_replace(VALUE copy, VALUE orig)
 		});
 	} else {
 		list_clear(copy);
-		LIST_FOR(orig, c_orig) {
-			list_push(copy, c_orig->value);
-		}
+		first = item_chain_copy(orig, olen, &last);
+		list_attach(LIST_PTR(copy), first, last, olen);
 	}
 
 	return copy;
@@ -575,12 +1281,19 @@ list_to_a(VALUE self)
 {
 	item_t *c;
 	VALUE ary;
-	long i = 0;
+	long i, len;
 
-	ary = rb_ary_new2(LIST_LEN(self));
-	LIST_FOR(self, c) {
-		rb_ary_store(ary, i++, c->value);
-	}
+	len = LIST_LEN(self);
+	ary = rb_ary_new2(len);
+	if (len == 0) return ary;
+	rb_ary_resize(ary, len);
+	c = LIST_PTR(self)->first;
+	RARRAY_PTR_USE(ary, ptr, {
+		for (i = 0; i < len; i++) {
+			ptr[i] = c->value;
+			c = c->next;
+		}
+	});
 	return ary;
 }
 
@@ -594,6 +1307,7 @@ list_frozen_p(VALUE self)
 static VALUE
 recursive_equal(VALUE list1, VALUE list2, int recur)
 {
+	struct cmp_opt opt = CMP_OPT_INIT;
 	item_t *c1, *c2;
 
 	if (recur) return Qtrue;
@@ -601,10 +1315,8 @@ recursive_equal(VALUE list1, VALUE list2, int recur)
 	if (LIST_LEN(list1) != LIST_LEN(list2)) return Qfalse;
 
 	LIST_FOR_DOUBLE(list1, c1, list2, c2, {
-		if (c1->value != c2->value) {
-			if (!rb_equal(c1->value, c2->value)) {
-				return Qfalse;
-			}
+		if (!optimized_equal(&opt, c1->value, c2->value)) {
+			return Qfalse;
 		}
 	});
 	return Qtrue;
@@ -644,20 +1356,76 @@ list_equal(VALUE self, VALUE obj)
 
 }
 
+static VALUE
+recursive_eql(VALUE list1, VALUE list2, int recur)
+{
+	item_t *c1, *c2;
+
+	if (recur) return Qtrue;
+
+	if (LIST_LEN(list1) != LIST_LEN(list2)) return Qfalse;
+
+	LIST_FOR_DOUBLE(list1, c1, list2, c2, {
+		if (!vset_eql(c1->value, c2->value)) {
+			return Qfalse;
+		}
+	});
+	return Qtrue;
+}
+
+static VALUE
+list_eql(VALUE self, VALUE obj)
+{
+	st_index_t h1, h2;
+
+	if (self == obj) return Qtrue;
+	if (!rb_obj_is_kind_of(obj, cList)) return Qfalse;
+	if (LIST_LEN(self) != LIST_LEN(obj)) return Qfalse;
+	h1 = LIST_RAW_PTR(self)->hash;
+	h2 = LIST_RAW_PTR(obj)->hash;
+	if (h1 && h2 && h1 != h2) return Qfalse;
+	return rb_exec_recursive_paired(recursive_eql, self, obj, obj);
+}
+
+/* whether the hash of v stays the same while it sits in a frozen List */
+static int
+hash_stable_p(VALUE v)
+{
+	if (SPECIAL_CONST_P(v)) return TRUE;
+	if (!OBJ_FROZEN(v)) return FALSE;
+	switch (BUILTIN_TYPE(v)) {
+	case T_STRING:
+		return RBASIC_CLASS(v) == rb_cString;
+	case T_FLOAT:
+	case T_BIGNUM:
+	case T_SYMBOL:
+		return TRUE;
+	case T_DATA:
+		return rb_obj_is_kind_of(v, cList) && LIST_RAW_PTR(v)->hash != 0;
+	default:
+		return FALSE;
+	}
+}
+
+/* elements hash like Hash keys do, without calling #hash on immediates */
 static VALUE
 list_hash(VALUE self)
 {
+	list_t *ptr = LIST_RAW_PTR(self);
 	item_t *c;
 	st_index_t h;
-	VALUE n;
+	int stable;
 
+	if (ptr->hash) return LONG2FIX(ptr->hash);
+	stable = OBJ_FROZEN(self);
 	h = rb_hash_start(LIST_LEN(self));
 	h = rb_hash_uint(h, (st_index_t)list_hash);
 	LIST_FOR(self, c) {
-		n = rb_hash(c->value);
-		h = rb_hash_uint(h, NUM2LONG(n));
+		h = rb_hash_uint(h, vset_hash(c->value));
+		if (stable) stable = hash_stable_p(c->value);
 	}
 	h = rb_hash_end(h);
+	if (stable) ptr->hash = h;
 	return LONG2FIX(h);
 }
 
@@ -668,14 +1436,15 @@ list_elt(VALUE self, long offset)
 	long len;
 	item_t *c;
 
-	len = LIST_LEN(self);
-	if (len == 0) return Qnil;
-	if (offset < 0 || len <= offset) {
+	if (offset < 0) return Qnil;
+	if (LIST_LAZY_P(self)) list_lazy_fill(self, offset + 1);
+	len = LIST_RAW_PTR(self)->aux.len;
+	if (len <= offset) {
 		return Qnil;
 	}
 
 	i = 0;
-	LIST_FOR(self, c) {
+	for (c = LIST_RAW_PTR(self)->first; c; c = c->next) {
 		if (i++ == offset) {
 			return c->value;
 		}
@@ -683,14 +1452,25 @@ list_elt(VALUE self, long offset)
 	return Qnil;
 }
 
+static long
+list_lazy_length(VALUE self)
+{
+	list_t *ptr = LIST_RAW_PTR(self);
+
+	if (ptr->lazy && 0 <= ptr->lazy->len) {
+		return ptr->lazy->len;
+	}
+	if (ptr->lazy && ptr->lazy->len == LAZY_LEN_INFINITE) {
+		rb_raise(rb_eRangeError, "infinite List has no end");
+	}
+	return LIST_LEN(self);
+}
+
 static VALUE
 list_entry(VALUE self, long offset)
 {
-	list_t *ptr;
-
-	Data_Get_Struct(self, list_t, ptr);
 	if (offset < 0) {
-		offset += LIST_LEN(self);
+		offset += list_lazy_length(self);
 	}
 	return list_elt(self, offset);
 }
@@ -699,21 +1479,21 @@ static VALUE
 list_make_partial(VALUE self, VALUE klass, long offset, long len)
 {
 	VALUE instance;
-	item_t *c;
+	item_t *c, *n, *first, *last;
 	long i;
 
 	instance = rb_obj_alloc(klass);
-	i = -1;
-	LIST_FOR(self, c) {
-		i++;
-		if (i < offset) continue;
-
-		if (i < offset + len) {
-			list_push(instance, c->value);
-		} else {
-			break;
-		}
+	if (len <= 0) return instance;
+	c = LIST_RAW_PTR(self)->first;
+	for (i = 0; i < offset; i++) {
+		c = c->next;
 	}
+	first = item_alloc_chain(len, &last);
+	for (n = first; n; n = n->next) {
+		n->value = c->value;
+		c = c->next;
+	}
+	list_attach(LIST_RAW_PTR(instance), first, last, len);
 	return instance;
 }
 
@@ -721,13 +1501,14 @@ static VALUE
 list_subseq(VALUE self, long beg, long len)
 {
 	long alen;
-	list_t *ptr;
 
-	Data_Get_Struct(self, list_t, ptr);
-	alen = LIST_LEN(self);
+	if (beg < 0 || len < 0) return Qnil;
+	if (LIST_LAZY_P(self)) {
+		list_lazy_fill(self, (LONG_MAX - len < beg) ? -1 : beg + len);
+	}
+	alen = LIST_LAZY_P(self) ? beg + len : LIST_LEN(self);
 
 	if (alen < beg) return Qnil;
-	if (beg < 0 || len < 0) return Qnil;
 
 	if (alen < len || alen < beg + len) {
 		len = alen - beg;
@@ -765,7 +1546,7 @@ list_aref(int argc, VALUE *argv, VALUE self)
 		return list_entry(self, FIX2LONG(arg));
 	}
 	/* check if idx is Range */
-	switch (rb_range_beg_len(arg, &beg, &len, LIST_LEN(self), 0)) {
+	switch (rb_range_beg_len(arg, &beg, &len, list_lazy_length(self), 0)) {
 	case Qfalse:
 		break;
 	case Qnil:
@@ -780,9 +1561,10 @@ static void
 list_splice(VALUE self, long beg, long len, VALUE rpl)
 {
 	long i;
-	long rlen, olen, alen;
-	item_t *c = NULL;
-	item_t *item_first = NULL, *item_last = NULL, *first = NULL, *last = NULL;
+	long rlen, olen;
+	list_t *ptr;
+	item_t *c, *rc, *next;
+	item_t *item_first = NULL, *item_last = NULL, *before = NULL;
 
 	if (len < 0)
 		rb_raise(rb_eIndexError, "negative length (%ld)", len);
@@ -801,6 +1583,8 @@ list_splice(VALUE self, long beg, long len, VALUE rpl)
 
 	if (rpl == Qundef) {
 		rlen = 0;
+	} else if (rb_obj_is_kind_of(rpl, cList)) {
+		rlen = LIST_LEN(rpl);
 	} else {
 		rpl = rb_ary_to_ary(rpl);
 		rlen = RARRAY_LEN(rpl);
@@ -810,55 +1594,54 @@ list_splice(VALUE self, long beg, long len, VALUE rpl)
 		if (LIST_MAX_SIZE - rlen < beg) {
 			rb_raise(rb_eIndexError, "index %ld too big", beg);
 		}
-		for (i = LIST_LEN(self); i < beg; i++) {
-			list_push(self, Qnil);
-		}
-		list_push_ary(self, rpl);
-	} else {
-		alen = olen + rlen - len;
-		if (len != rlen) {
-			for (i = rlen; 0 < i; i--) {
-				c = item_alloc(rb_ary_entry(rpl, i - 1), c);
-				if (i == rlen) {
-					item_last = c;
-				}
-			}
-			item_first = c;
-
-			i = -1;
-			LIST_FOR(self, c) {
-				i++;
-				if (i == beg - 1) {
-					first = c;
-				}
-				if (i == beg + len) {
-					last = c;
-					break;
-				}
-			}
-			if (beg == 0) {
-				LIST_PTR(self)->first = item_first;
-			} else {
-				first->next = item_first;
-			}
-			if (rlen == 0) {
-				LIST_PTR(self)->last = first;
-				LIST_PTR(self)->last->next = NULL;
+		list_push_fill(self, beg - LIST_LEN(self), Qnil);
+		len = 0;
+	} else if (len == rlen) {
+		if (rlen == 0) return;
+		i = -1;
+		rc = (TYPE(rpl) == T_ARRAY) ? NULL : LIST_PTR(rpl)->first;
+		LIST_FOR(self, c) {
+			i++;
+			if (i < beg) continue;
+			if (beg + rlen <= i) break;
+			if (rc) {
+				c->value = rc->value;
+				rc = rc->next;
 			} else {
-				item_last->next = last;
-			}
-			LIST_LEN(self) += rlen - len;
-		} else {
-			i = -1;
-			LIST_FOR(self, c) {
-				i++;
-				if (beg <= i && i < beg + rlen) {
-					c->value = rb_ary_entry(rpl, i - beg);
-				}
+				c->value = rb_ary_entry(rpl, i - beg);
 			}
 		}
+		return;
+	}
 
+	if (0 < rlen) {
+		item_first = item_chain_copy(rpl, rlen, &item_last);
+	}
+	ptr = LIST_PTR(self);
+	c = ptr->first;
+	for (i = 0; i < beg; i++) {
+		before = c;
+		c = c->next;
+	}
+	for (i = 0; i < len; i++) {
+		next = c->next;
+		item_free(c);
+		c = next;
+	}
+	if (0 < rlen) {
+		item_last->next = c;
+	} else {
+		item_first = c;
+	}
+	if (before) {
+		before->next = item_first;
+	} else {
+		ptr->first = item_first;
 	}
+	if (c == NULL) {
+		ptr->last = (0 < rlen) ? item_last : before;
+	}
+	LIST_PTR_LEN(ptr) += rlen - len;
 }
 
 static void
@@ -880,9 +1663,9 @@ list_store(VALUE self, long idx, VALUE val)
 	}
 
 	if (LIST_LEN(self) <= idx) {
-		for (i = LIST_LEN(self); i <= idx; i++) {
-			list_push(self, Qnil);
-		}
+		list_push_fill(self, idx + 1 - LIST_LEN(self), Qnil);
+		LIST_PTR(self)->last->value = val;
+		return;
 	}
 
 	i = -1;
@@ -975,7 +1758,10 @@ list_take_first_or_last(int argc, VALUE *argv, VALUE self, enum list_take_pos_fl
 	Data_Get_Struct(self, list_t, ptr);
 	rb_scan_args(argc, argv, "1", &nv);
 	n = NUM2LONG(nv);
-	len = LIST_LEN(self);
+	if (flag == LIST_TAKE_FIRST && 0 < n && ptr->lazy) {
+		list_lazy_fill(self, n);
+	}
+	len = (flag == LIST_TAKE_FIRST && ptr->lazy) ? n : LIST_LEN(self);
 	if (n > len) {
 		n = len;
 	} else if (n < 0) {
@@ -993,7 +1779,7 @@ list_first(int argc, VALUE *argv, VALUE self)
 	list_t *ptr;
 	Data_Get_Struct(self, list_t, ptr);
 	if (argc == 0) {
-		if (ptr->first == NULL) return Qnil;
+		if (list_lazy_first(self) == NULL) return Qnil;
 		return ptr->first->value;
 	} else {
 		return list_take_first_or_last(argc, argv, self, LIST_TAKE_FIRST);
@@ -1024,7 +1810,7 @@ list_concat(VALUE self, VALUE obj)
 
 	list_modify_check(self);
 	type = rb_type(obj);
-	if (type == T_DATA) {
+	if (type == T_DATA && rb_obj_is_kind_of(obj, cList)) {
 		len = LIST_LEN(obj);
 	} else if (type == T_ARRAY) {
 		len = RARRAY_LEN(obj);
@@ -1039,6 +1825,77 @@ list_concat(VALUE self, VALUE obj)
 	return self;
 }
 
+/* move all items of donor to the tail of self without copying */
+static void
+list_steal(VALUE self, VALUE donor)
+{
+	list_t *ptr, *dptr;
+
+	list_modify_check(donor);
+	dptr = LIST_PTR(donor);
+	if (dptr->first == NULL) return;
+	ptr = LIST_PTR(self);
+	list_attach(ptr, dptr->first, dptr->last, LIST_PTR_LEN(dptr));
+	dptr->first = NULL;
+	dptr->last = NULL;
+	LIST_PTR_LEN(dptr) = 0;
+}
+
+/* move all items of from in front of ptr, skipping the frozen check
+ * so that it can run from an ensure */
+static void
+list_prepend_raw(list_t *ptr, list_t *from)
+{
+	if (from->first == NULL) return;
+	from->last->next = ptr->first;
+	if (ptr->first == NULL) {
+		ptr->last = from->last;
+	}
+	ptr->first = from->first;
+	LIST_PTR_LEN(ptr) += LIST_PTR_LEN(from);
+	from->first = from->last = NULL;
+	LIST_PTR_LEN(from) = 0;
+}
+
+static VALUE
+list_concat_bang(VALUE self, VALUE obj)
+{
+	list_modify_check(self);
+	if (self == obj) {
+		rb_raise(rb_eArgError, "cannot move items of `List' into itself");
+	}
+	if (!rb_obj_is_kind_of(obj, cList)) {
+		obj = to_list(obj);
+	}
+	list_steal(self, obj);
+	return self;
+}
+
+static VALUE
+list_s_concat_all(VALUE klass, VALUE lists)
+{
+	VALUE result, srcs, src;
+	long i;
+
+	lists = rb_convert_type(lists, T_ARRAY, "Array", "to_a");
+	/* check every source before emptying any of them */
+	srcs = rb_ary_new2(RARRAY_LEN(lists));
+	for (i = 0; i < RARRAY_LEN(lists); i++) {
+		src = rb_ary_entry(lists, i);
+		if (!rb_obj_is_kind_of(src, cList)) {
+			src = to_list(src);
+		}
+		list_modify_check(src);
+		rb_ary_push(srcs, src);
+	}
+	result = rb_obj_alloc(klass);
+	for (i = 0; i < RARRAY_LEN(srcs); i++) {
+		list_steal(result, RARRAY_AREF(srcs, i));
+	}
+	RB_GC_GUARD(srcs);
+	return result;
+}
+
 static VALUE
 list_pop(VALUE self)
 {
@@ -1051,10 +1908,66 @@ list_pop(VALUE self)
 	return result;
 }
 
+/* unlink len items from beg and hand over the run to a new List */
+static VALUE
+list_detach(VALUE self, long beg, long len)
+{
+	VALUE result = list_new();
+	list_t *ptr, *rptr;
+	item_t *before = NULL, *first, *last;
+	long i;
+
+	if (len == 0) return result;
+	ptr = LIST_PTR(self);
+	first = ptr->first;
+	for (i = 0; i < beg; i++) {
+		before = first;
+		first = first->next;
+	}
+	if (beg + len == LIST_PTR_LEN(ptr)) {
+		last = ptr->last;
+		ptr->last = before;
+	} else {
+		last = first;
+		for (i = 1; i < len; i++) {
+			last = last->next;
+		}
+	}
+	if (before) {
+		before->next = last->next;
+	} else {
+		ptr->first = last->next;
+	}
+	last->next = NULL;
+	LIST_PTR_LEN(ptr) -= len;
+
+	rptr = LIST_RAW_PTR(result);
+	rptr->first = first;
+	rptr->last = last;
+	LIST_PTR_LEN(rptr) = len;
+	return result;
+}
+
+static long
+list_take_size(int argc, VALUE *argv, VALUE self)
+{
+	VALUE nv;
+	long n;
+
+	rb_scan_args(argc, argv, "1", &nv);
+	n = NUM2LONG(nv);
+	if (n < 0) {
+		rb_raise(rb_eArgError, "negative array size");
+	}
+	if (LIST_LEN(self) < n) {
+		n = LIST_LEN(self);
+	}
+	return n;
+}
+
 static VALUE
 list_pop_m(int argc, VALUE *argv, VALUE self)
 {
-	VALUE result;
 	long n;
 
 	if (argc == 0) {
@@ -1062,10 +1975,8 @@ list_pop_m(int argc, VALUE *argv, VALUE self)
 	}
 
 	list_modify_check(self);
-	result = list_take_first_or_last(argc, argv, self, LIST_TAKE_LAST);
-	n = NUM2LONG(argv[0]);
-	list_mem_clear(self, LIST_LEN(self) - n, n);
-	return result;
+	n = list_take_size(argc, argv, self);
+	return list_detach(self, LIST_LEN(self) - n, n);
 }
 
 static VALUE
@@ -1073,6 +1984,7 @@ list_shift(VALUE self)
 {
 	VALUE result;
 
+	list_modify_check(self);
 	if (LIST_LEN(self) == 0) return Qnil;
 	result = list_first(0, NULL, self);
 	list_mem_clear(self, 0, 1);
@@ -1082,21 +1994,12 @@ list_shift(VALUE self)
 static VALUE
 list_shift_m(int argc, VALUE *argv, VALUE self)
 {
-	VALUE result;
-	long i;
-	list_t *ptr;
-
 	if (argc == 0) {
 		return list_shift(self);
 	}
 
 	list_modify_check(self);
-	result = list_take_first_or_last(argc, argv, self, LIST_TAKE_FIRST);
-	Data_Get_Struct(result, list_t, ptr);
-	for (i = 0; i < LIST_LEN(self); i++) {
-		list_shift(self);
-	}
-	return result;
+	return list_detach(self, 0, list_take_size(argc, argv, self));
 }
 
 static VALUE
@@ -1155,37 +2058,37 @@ list_insert(int argc, VALUE *argv, VALUE self)
 static VALUE
 list_length(VALUE self)
 {
-	list_t *ptr;
-	Data_Get_Struct(self, list_t, ptr);
-	return LONG2NUM(LIST_LEN(self));
+	list_lazy_t *lazy = LIST_RAW_PTR(self)->lazy;
+
+	if (lazy && lazy->len == LAZY_LEN_INFINITE) {
+		return DBL2NUM(INFINITY);
+	}
+	return LONG2NUM(list_lazy_length(self));
 }
 
 static VALUE
 list_empty_p(VALUE self)
 {
-	list_t *ptr;
-	Data_Get_Struct(self, list_t, ptr);
-	if (LIST_LEN(self) == 0)
+	if (list_lazy_first(self) == NULL)
 		return Qtrue;
 	return Qfalse;
 }
 
 static VALUE
-list_rindex(int argc, VALUE *argv, VALUE self)
+list_find_index(int argc, VALUE *argv, VALUE self)
 {
-	long i;
-	long len;
+	struct cmp_opt opt = CMP_OPT_INIT;
+	item_t *c;
 	VALUE val;
+	long i = 0;
 
-	i = LIST_LEN(self);
 	if (argc == 0) {
 		RETURN_ENUMERATOR(self, 0, 0);
-		while (i--) {
-			if (RTEST(rb_yield(list_elt(self, i))))
+		LIST_FOR_LAZY(self, c) {
+			if (RTEST(rb_yield(c->value))) {
 				return LONG2NUM(i);
-			if (LIST_LEN(self) < i) {
-				i = LIST_LEN(self);
 			}
+			i++;
 		}
 		return Qnil;
 	}
@@ -1193,150 +2096,402 @@ list_rindex(int argc, VALUE *argv, VALUE self)
 	val = argv[0];
 	if (rb_block_given_p())
 		rb_warn("given block not used");
-	while (i--) {
-		if (rb_equal(list_elt(self, i), val)) {
+	LIST_FOR_LAZY(self, c) {
+		if (optimized_equal(&opt, c->value, val)) {
 			return LONG2NUM(i);
 		}
-		len = LIST_LEN(self);
-		if (len < i) {
-			i = len;
-		}
+		i++;
 	}
 	return Qnil;
 }
 
-extern VALUE rb_output_fs;
+/* pattern === v, done inline for Modules and immediates whose === is builtin */
+enum pattern_kind {
+	PATTERN_CALL,
+	PATTERN_MODULE,
+	PATTERN_EQUAL
+};
 
-static void list_join_1(VALUE obj, VALUE ary, VALUE sep, long i, VALUE result, int *first);
+struct pattern {
+	VALUE pat;
+	enum pattern_kind kind;
+	struct cmp_opt opt;
+};
 
-static VALUE
-recursive_join(VALUE obj, VALUE argp, int recur)
+static void
+pattern_init(struct pattern *p, VALUE pat)
 {
-	VALUE *arg = (VALUE *)argp;
-	VALUE list = arg[0];
-	VALUE sep = arg[1];
-	VALUE result = arg[2];
-	int *first = (int *)arg[3];
+	struct cmp_opt opt = CMP_OPT_INIT;
 
-	if (recur) {
-		rb_raise(rb_eArgError, "recursive list join");
-	} else {
-		list_join_1(obj, list, sep, 0, result, first);
+	p->pat = pat;
+	p->opt = opt;
+	p->kind = PATTERN_CALL;
+	if (!rb_method_basic_definition_p(CLASS_OF(pat), id_eqq)) return;
+	if (RB_TYPE_P(pat, T_CLASS) || RB_TYPE_P(pat, T_MODULE)) {
+		p->kind = PATTERN_MODULE;
+	} else if (SPECIAL_CONST_P(pat)) {
+		p->kind = PATTERN_EQUAL;
 	}
-	return Qnil;
 }
 
-/* only string join */
-static void
-list_join_0(VALUE self, VALUE sep, long max, VALUE result)
+static inline int
+pattern_match(struct pattern *p, VALUE v)
 {
-	list_t *ptr;
+	switch (p->kind) {
+	case PATTERN_MODULE:
+		return RTEST(rb_obj_is_kind_of(v, p->pat));
+	case PATTERN_EQUAL:
+		return optimized_equal(&p->opt, p->pat, v);
+	default:
+		return RTEST(rb_funcall(p->pat, id_eqq, 1, v));
+	}
+}
+
+enum quantifier {
+	QUANT_ANY,
+	QUANT_ALL,
+	QUANT_NONE,
+	QUANT_ONE
+};
+
+/* any?, all?, none? and one?, stopping as soon as the answer is known */
+static VALUE
+list_quantify(int argc, VALUE *argv, VALUE self, enum quantifier q)
+{
+	struct pattern pat;
 	item_t *c;
-	long i = 1;
+	long hits = 0;
+	int block_given = rb_block_given_p(), t;
+
+	if (rb_check_arity(argc, 0, 1)) {
+		if (block_given) rb_warn("given block not used");
+		pattern_init(&pat, argv[0]);
+	}
+	LIST_FOR_LAZY(self, c) {
+		if (argc) {
+			t = pattern_match(&pat, c->value);
+		} else if (block_given) {
+			t = RTEST(rb_yield(c->value));
+		} else {
+			t = RTEST(c->value);
+		}
+		switch (q) {
+		case QUANT_ANY:
+			if (t) return Qtrue;
+			break;
+		case QUANT_ALL:
+			if (!t) return Qfalse;
+			break;
+		case QUANT_NONE:
+			if (t) return Qfalse;
+			break;
+		case QUANT_ONE:
+			if (t && 1 < ++hits) return Qfalse;
+			break;
+		}
+	}
+	switch (q) {
+	case QUANT_ANY:
+		return Qfalse;
+	case QUANT_ONE:
+		return hits == 1 ? Qtrue : Qfalse;
+	default:
+		return Qtrue;
+	}
+}
 
-	Data_Get_Struct(self, list_t, ptr);
-	if (0 < max) rb_enc_copy(result, list_elt(self, 0));
-	if (max <= i) return;
-	c = ptr->first;
-	rb_str_buf_append(result, c->value);
-	for (c = c->next; i < max; c = c->next) {
-		if (!NIL_P(sep))
-			rb_str_buf_append(result, sep);
-		rb_str_buf_append(result, c->value);
-		i++;
+static VALUE
+list_any_p(int argc, VALUE *argv, VALUE self)
+{
+	return list_quantify(argc, argv, self, QUANT_ANY);
+}
+
+static VALUE
+list_all_p(int argc, VALUE *argv, VALUE self)
+{
+	return list_quantify(argc, argv, self, QUANT_ALL);
+}
+
+static VALUE
+list_none_p(int argc, VALUE *argv, VALUE self)
+{
+	return list_quantify(argc, argv, self, QUANT_NONE);
+}
+
+static VALUE
+list_one_p(int argc, VALUE *argv, VALUE self)
+{
+	return list_quantify(argc, argv, self, QUANT_ONE);
+}
+
+static VALUE
+list_find(int argc, VALUE *argv, VALUE self)
+{
+	VALUE if_none = Qnil;
+	item_t *c;
+
+	RETURN_ENUMERATOR(self, argc, argv);
+	rb_scan_args(argc, argv, "01", &if_none);
+	LIST_FOR_LAZY(self, c) {
+		if (RTEST(rb_yield(c->value))) {
+			return c->value;
+		}
+	}
+	if (!NIL_P(if_none)) {
+		return rb_funcallv(if_none, id_call, 0, 0);
 	}
+	return Qnil;
 }
 
-/* another object join */
-static void
-list_join_1(VALUE obj, VALUE list, VALUE sep, long i, VALUE result, int *first)
+static VALUE
+list_each_with_index(VALUE self)
 {
 	item_t *c;
-	VALUE val, tmp;
+	long i = 0;
 
-	if (LIST_LEN(list) == 0) return;
+	RETURN_SIZED_ENUMERATOR(self, 0, 0, list_enum_length);
+	LIST_FOR_LAZY(self, c) {
+		rb_yield_values(2, c->value, LONG2NUM(i++));
+	}
+	return self;
+}
 
-	LIST_FOR(list, c) {
-		val = c->value;
-		if (0 < i++ && !NIL_P(sep))
-			rb_str_buf_append(result, sep);
+static VALUE
+list_rindex(int argc, VALUE *argv, VALUE self)
+{
+	struct cmp_opt opt = CMP_OPT_INIT;
+	long i;
+	long len;
+	VALUE val;
 
-		switch (rb_type(val)) {
-		case T_STRING:
-			str_join:
-			rb_str_buf_append(result, val);
-			*first = FALSE;
-			break;
-		case T_ARRAY:
-			val = to_list(val);
-		case T_DATA:
-			obj = val;
-			list_join:
-			if (val == list) {
-				rb_raise(rb_eArgError, "recursive list join");
-			}
-			VALUE args[4];
-			args[0] = val;
-			args[1] = sep;
-			args[2] = result;
-			args[3] = (VALUE)first;
-			rb_exec_recursive(recursive_join, obj, (VALUE)args);
-			break;
-		default:
-			tmp = rb_check_string_type(val);
-			if (!NIL_P(tmp)) {
-				val = tmp;
-				goto str_join;
+	i = LIST_LEN(self);
+	if (argc == 0) {
+		RETURN_ENUMERATOR(self, 0, 0);
+		while (i--) {
+			if (RTEST(rb_yield(list_elt(self, i))))
+				return LONG2NUM(i);
+			if (LIST_LEN(self) < i) {
+				i = LIST_LEN(self);
 			}
-			tmp = rb_check_convert_type(val, T_DATA, "List", "to_list");
-			if (!NIL_P(tmp)) {
-				obj = val;
-				val = tmp;
-				goto list_join;
+		}
+		return Qnil;
+	}
+	rb_check_arity(argc, 0, 1);
+	val = argv[0];
+	if (rb_block_given_p())
+		rb_warn("given block not used");
+	while (i--) {
+		if (optimized_equal(&opt, list_elt(self, i), val)) {
+			return LONG2NUM(i);
+		}
+		len = LIST_LEN(self);
+		if (len < i) {
+			i = len;
+		}
+	}
+	return Qnil;
+}
+
+extern VALUE rb_output_fs;
+
+/* join: one walk, nested Lists and Arrays on an explicit stack */
+#define JOIN_CHUNK 8192
+
+struct join_frame {
+	VALUE obj;	/* List or Array being walked */
+	VALUE orig;	/* element it came from, for the recursion check */
+	item_t *c;
+	long i;
+};
+
+struct join {
+	struct join_frame *frames;
+	long depth;
+	long capa;
+	VALUE result;
+	VALUE io;
+	VALUE sep;
+	int first;
+	struct cmp_opt opt;
+};
+
+static void
+join_mark(struct join *j)
+{
+	long i;
+
+	for (i = 0; i < j->depth; i++) {
+		rb_gc_mark(j->frames[i].obj);
+		rb_gc_mark(j->frames[i].orig);
+	}
+	rb_gc_mark(j->result);
+	rb_gc_mark(j->io);
+	rb_gc_mark(j->sep);
+}
+
+static void
+join_free(struct join *j)
+{
+	xfree(j->frames);
+	xfree(j);
+}
+
+static void
+join_flush(struct join *j)
+{
+	if (NIL_P(j->io) || RSTRING_LEN(j->result) < JOIN_CHUNK) return;
+	rb_io_write(j->io, j->result);
+	/* the writer may keep the chunk, so start a new one */
+	j->result = rb_str_buf_new(JOIN_CHUNK);
+	rb_enc_associate(j->result, rb_usascii_encoding());
+	j->first = TRUE;
+}
+
+static void
+join_cat_str(struct join *j, VALUE str)
+{
+	rb_str_buf_append(j->result, str);
+	if (j->first) {
+		rb_enc_copy(j->result, str);
+		j->first = FALSE;
+	}
+	join_flush(j);
+}
+
+static void
+join_cat_fixnum(struct join *j, VALUE v)
+{
+	char buf[sizeof(long) * CHAR_BIT / 3 + 3];
+	char *p = buf + sizeof(buf);
+	long n = FIX2LONG(v);
+	unsigned long u = n < 0 ? -(unsigned long)n : (unsigned long)n;
+
+	do {
+		*--p = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	if (n < 0) *--p = '-';
+	rb_str_buf_cat(j->result, p, buf + sizeof(buf) - p);
+	j->first = FALSE;
+	join_flush(j);
+}
+
+static void
+join_push(struct join *j, VALUE obj, VALUE orig)
+{
+	struct join_frame *f;
+	long i;
+
+	for (i = 0; i < j->depth; i++) {
+		if (j->frames[i].obj == obj || j->frames[i].orig == orig) {
+			rb_raise(rb_eArgError, "recursive list join");
+		}
+	}
+	if (j->depth == j->capa) {
+		j->capa = j->capa ? j->capa * 2 : 8;
+		REALLOC_N(j->frames, struct join_frame, j->capa);
+	}
+	f = &j->frames[j->depth];
+	f->obj = obj;
+	f->orig = orig;
+	f->c = RB_TYPE_P(obj, T_ARRAY) ? NULL : LIST_PTR(obj)->first;
+	f->i = 0;
+	j->depth++;
+}
+
+static void
+join_elt(struct join *j, VALUE val)
+{
+	VALUE tmp;
+
+	if (RB_TYPE_P(val, T_STRING)) {
+		join_cat_str(j, val);
+	} else if (FIXNUM_P(val) &&
+		   rb_enc_asciicompat(rb_enc_get(j->result)) &&
+		   cmp_opt_basic_p(&j->opt, CMP_OPT_INTEGER, rb_cInteger, id_to_s)) {
+		join_cat_fixnum(j, val);
+	} else if (SYMBOL_P(val) &&
+		   cmp_opt_basic_p(&j->opt, CMP_OPT_SYMBOL, rb_cSymbol, id_to_s)) {
+		join_cat_str(j, rb_sym2str(val));
+	} else if (RB_TYPE_P(val, T_ARRAY) || rb_obj_is_kind_of(val, cList)) {
+		j->first = FALSE;
+		join_push(j, val, val);
+	} else if (!NIL_P(tmp = rb_check_string_type(val))) {
+		join_cat_str(j, tmp);
+	} else if (!NIL_P(tmp = rb_check_convert_type(val, T_DATA, "List", "to_list"))) {
+		j->first = FALSE;
+		join_push(j, tmp, val);
+	} else {
+		join_cat_str(j, rb_obj_as_string(val));
+	}
+}
+
+static void
+join_walk(struct join *j, VALUE self)
+{
+	struct join_frame *f;
+	VALUE val;
+
+	join_push(j, self, self);
+	while (0 < j->depth) {
+		f = &j->frames[j->depth - 1];
+		if (RB_TYPE_P(f->obj, T_ARRAY)) {
+			if (RARRAY_LEN(f->obj) <= f->i) {
+				j->depth--;
+				continue;
 			}
-			val = rb_obj_as_string(val);
-			if (*first) {
-				rb_enc_copy(result, val);
-				*first = FALSE;
+			val = RARRAY_AREF(f->obj, f->i);
+		} else {
+			if (f->c == NULL) {
+				j->depth--;
+				continue;
 			}
-			goto str_join;
+			val = f->c->value;
+			f->c = f->c->next;
+		}
+		if (0 < f->i++ && !NIL_P(j->sep)) {
+			rb_str_buf_append(j->result, j->sep);
 		}
+		join_elt(j, val);
 	}
 }
 
+static VALUE
+list_join_into(VALUE self, VALUE sep, VALUE result, VALUE io)
+{
+	struct join *j;
+	VALUE holder;
+
+	j = ALLOC(struct join);
+	MEMZERO(j, struct join, 1);
+	j->result = result;
+	j->io = io;
+	j->sep = sep;
+	j->first = NIL_P(io) && RSTRING_LEN(result) == 0;
+	holder = Data_Wrap_Struct(0, join_mark, join_free, j);
+	join_walk(j, self);
+	result = j->result;
+	RB_GC_GUARD(holder);
+	return result;
+}
+
 static VALUE
 list_join(VALUE self, VALUE sep)
 {
-	long len = 1;
-	long i = 0;
-	VALUE val, tmp;
+	long len = LIST_LEN(self);
+	long capa;
 	VALUE result;
-	item_t *c;
-	int first;
 
-	if (LIST_LEN(self) == 0) return rb_usascii_str_new(0, 0);
+	if (len == 0) return rb_usascii_str_new(0, 0);
 
+	capa = len * 8;
 	if (!NIL_P(sep)) {
 		StringValue(sep);
-		len += RSTRING_LEN(sep) * (LIST_LEN(self) - 1);
-	}
-	LIST_FOR(self, c) {
-		val = c->value;
-		tmp = rb_check_string_type(val);
-		if (NIL_P(val) || c->value != tmp) {
-			result = rb_str_buf_new(len + LIST_LEN(self));
-			rb_enc_associate(result, rb_usascii_encoding());
-			list_join_0(self, sep, i, result);
-			first = i == 0;
-			list_join_1(self, self, sep, i, result, &first);
-			return result;
-		}
-		len += RSTRING_LEN(val);
+		capa += RSTRING_LEN(sep) * (len - 1);
 	}
-	result = rb_str_buf_new(len);
-	list_join_0(self, sep, LIST_LEN(self), result);
-
-	return result;
+	result = rb_str_buf_new(capa);
+	rb_enc_associate(result, rb_usascii_encoding());
+	return list_join_into(self, sep, result, Qnil);
 }
 
 static VALUE
@@ -1350,19 +2505,49 @@ list_join_m(int argc, VALUE *argv, VALUE self)
 	return list_join(self, sep);
 }
 
+static VALUE
+list_join_to(int argc, VALUE *argv, VALUE self)
+{
+	VALUE out, sep, chunk;
+
+	rb_scan_args(argc, argv, "11", &out, &sep);
+	if (NIL_P(sep)) sep = rb_output_fs;
+	if (!NIL_P(sep)) StringValue(sep);
+
+	if (RB_TYPE_P(out, T_STRING)) {
+		rb_str_modify(out);
+		list_join_into(self, sep, out, Qnil);
+		return out;
+	}
+	if (!rb_respond_to(out, id_write)) {
+		rb_raise(rb_eTypeError, "wrong argument type %"PRIsVALUE" (expected String or IO)",
+			 rb_obj_class(out));
+	}
+	chunk = rb_str_buf_new(JOIN_CHUNK);
+	rb_enc_associate(chunk, rb_usascii_encoding());
+	chunk = list_join_into(self, sep, chunk, out);
+	if (0 < RSTRING_LEN(chunk)) {
+		rb_io_write(out, chunk);
+	}
+	return out;
+}
+
 static VALUE
 list_reverse_bang(VALUE self)
 {
-	VALUE tmp;
-	item_t *c;
-	long len;
+	list_t *ptr;
+	item_t *c, *prev = NULL, *next;
 
-	if (LIST_LEN(self) == 0) return self;
-	tmp = list_to_a(self);
-	len = LIST_LEN(self);
-	LIST_FOR(self, c) {
-		c->value = rb_ary_entry(tmp, --len);
+	list_modify_check(self);
+	ptr = LIST_PTR(self);
+	if (ptr->first == NULL) return self;
+	for (c = ptr->first; c; c = next) {
+		next = c->next;
+		c->next = prev;
+		prev = c;
 	}
+	ptr->last = ptr->first;
+	ptr->first = prev;
 	return self;
 }
 
@@ -1370,13 +2555,22 @@ static VALUE
 list_reverse_m(VALUE self)
 {
 	VALUE result;
-	item_t *c;
+	list_t *rptr;
+	item_t *c, *n, *pool, *last;
 
 	result = list_new();
 	if (LIST_LEN(self) == 0) return result;
+	pool = item_alloc_chain(LIST_LEN(self), &last);
+	rptr = LIST_RAW_PTR(result);
+	rptr->last = pool;
 	LIST_FOR(self, c) {
-		list_unshift(result, c->value);
+		n = pool;
+		pool = pool->next;
+		n->value = c->value;
+		n->next = rptr->first;
+		rptr->first = n;
 	}
+	LIST_PTR_LEN(rptr) = LIST_LEN(self);
 	return result;
 }
 
@@ -1415,899 +2609,3460 @@ list_rotate_m(int argc, VALUE *argv, VALUE self)
 	return list_rotate_bang(argc, argv, clone);
 }
 
-static VALUE
-list_sort_bang(VALUE self)
+/*
+ * Stable natural merge sort relinking the chain in place.
+ *
+ * Runs are found by scanning the chain (strictly descending ones are
+ * reversed) and merged on a stack kept balanced with the TimSort rules.
+ * For sort_by the keys are collected first; unless they can be radix
+ * sorted, each item is then followed by a temporary item holding its key,
+ * and the pair moves as one unit.
+ * The chain is detached from the list while sorting; the pieces are
+ * marked through the state object and given back even on exceptions.
+ */
+
+#define SORT_MAX_RUNS 85
+
+enum sort_mode {
+	SORT_CMP,
+	SORT_BLOCK,
+	SORT_BY
+};
+
+struct radix_pair {
+	uint64_t key;	/* a key VALUE until the radix pass maps it */
+	item_t *item;
+};
+
+struct sort_run {
+	item_t *head;
+	item_t *last;	/* first item of the last unit */
+	item_t *tail;
+	long len;
+};
+
+struct sort_data {
+	list_t *ptr;
+	enum sort_mode mode;
+	int paired;	/* each item is followed by its key item */
+	struct cmp_opt opt;
+	long len;
+	struct radix_pair *keys;
+	long nkeys;	/* keys[] holding live VALUEs */
+	item_t *rest;	/* not yet split into runs */
+	struct sort_run runs[SORT_MAX_RUNS];
+	int nruns;
+	int merging;	/* runs[merge_at] and the next one are in out, a and b */
+	int merge_at;
+	struct sort_run out;
+	struct sort_run a;
+	struct sort_run b;
+	list_t *optr;	/* merge!: the donor, until the merge is done */
+};
+
+static void
+sort_mark_run(struct sort_run *run)
 {
 	item_t *c;
-	long i = 0;
 
-	VALUE ary = list_to_a(self);
-	rb_ary_sort_bang(ary);
-	LIST_FOR(self, c) {
-		c->value = rb_ary_entry(ary, i++);
+	for (c = run->head; c; c = c->next) {
+		rb_gc_mark(c->value);
+		if (c == run->tail) break;
 	}
-	return self;
 }
 
-static VALUE
-list_sort(VALUE self)
+static void
+sort_mark(struct sort_data *data)
 {
-	VALUE clone = rb_obj_clone(self);
-	return list_sort_bang(clone);
+	item_t *c;
+	long i;
+
+	if (data == NULL) return;
+	for (i = 0; i < data->nkeys; i++) {
+		rb_gc_mark((VALUE)data->keys[i].key);
+	}
+	for (i = 0; i < data->nruns; i++) {
+		if (data->merging && (i == data->merge_at || i == data->merge_at + 1)) continue;
+		sort_mark_run(&data->runs[i]);
+	}
+	if (data->merging) {
+		sort_mark_run(&data->out);
+		sort_mark_run(&data->a);
+		sort_mark_run(&data->b);
+	}
+	for (c = data->rest; c; c = c->next) {
+		rb_gc_mark(c->value);
+	}
 }
 
-static VALUE
-sort_by_i(VALUE i, VALUE _data, int argc, VALUE *argv)
+static inline item_t *
+sort_unit_tail(struct sort_data *data, item_t *c)
 {
-	return rb_yield(i);
+	return data->paired ? c->next : c;
 }
 
-static VALUE
-list_sort_by(VALUE self)
+static int
+sort_cmp(struct sort_data *data, item_t *x, item_t *y)
 {
-	VALUE ary;
+	VALUE a, b, ret;
+	int r;
 
-	RETURN_SIZED_ENUMERATOR(self, 0, 0, list_enum_length);
-	ary = rb_block_call(list_to_a(self), rb_intern("sort_by"), 0, 0, sort_by_i, 0);
-	return to_list(ary);
+	if (data->paired) {
+		x = x->next;
+		y = y->next;
+	}
+	a = x->value;
+	b = y->value;
+	if (data->mode == SORT_BLOCK) {
+		ret = rb_yield_values(2, a, b);
+	} else {
+		if (optimized_cmp(&data->opt, a, b, &r)) return r;
+		ret = rb_funcall(a, id_cmp, 1, b);
+	}
+	return rb_cmpint(ret, a, b);
 }
 
-static VALUE
-list_sort_by_bang(VALUE self)
-{
-	VALUE sorted;
-
-	sorted = list_sort_by(self);
-	return list_replace(self, sorted);
+/* cut the next natural run off data->rest */
+static void
+sort_take_run(struct sort_data *data, struct sort_run *run)
+{
+	item_t *c = data->rest, *prev, *next;
+	int desc;
+
+	run->head = run->last = c;
+	run->tail = sort_unit_tail(data, c);
+	run->len = 1;
+	next = run->tail->next;
+	if (next == NULL) goto done;
+
+	desc = 0 < sort_cmp(data, c, next);
+	do {
+		prev = next;
+		run->last = next;
+		run->tail = sort_unit_tail(data, next);
+		run->len++;
+		next = run->tail->next;
+	} while (next && (desc ? 0 < sort_cmp(data, prev, next) : sort_cmp(data, prev, next) <= 0));
+
+	if (desc) {
+		item_t *r = NULL, *u = c, *ut, *un;
+		long i;
+
+		for (i = 0; i < run->len; i++) {
+			ut = sort_unit_tail(data, u);
+			un = ut->next;
+			ut->next = r;
+			r = u;
+			u = un;
+		}
+		run->head = r;
+		run->last = c;
+		run->tail = sort_unit_tail(data, c);
+		run->tail->next = next;
+	}
+done:
+	data->rest = next;
 }
 
-static VALUE
-list_collect_bang(VALUE self)
+static inline void
+sort_out_append(struct sort_data *data, item_t *c)
 {
-	item_t *c;
+	struct sort_run *out = &data->out;
 
-	RETURN_SIZED_ENUMERATOR(self, 0, 0, list_enum_length);
-	LIST_FOR(self, c) {
-		c->value = rb_yield(c->value);
+	if (out->head) {
+		out->tail->next = c;
+	} else {
+		out->head = c;
 	}
-	return self;
+	out->last = c;
+	out->tail = sort_unit_tail(data, c);
 }
 
-static VALUE
-list_collect(VALUE self)
+static void
+sort_merge_at(struct sort_data *data, int k)
 {
-	return list_collect_bang(rb_obj_clone(self));
+	struct sort_run *x = &data->runs[k], *y = &data->runs[k + 1], *from;
+	item_t *c;
+	int i;
+
+	if (sort_cmp(data, x->last, y->head) <= 0) {
+		/* already in order */
+		x->tail->next = y->head;
+		x->last = y->last;
+		x->tail = y->tail;
+		x->len += y->len;
+		goto pop;
+	}
+	data->out.head = NULL;
+	data->a = *x;
+	data->b = *y;
+	data->merge_at = k;
+	data->merging = 1;
+	while (data->a.head && data->b.head) {
+		from = sort_cmp(data, data->b.head, data->a.head) < 0 ? &data->b : &data->a;
+		c = from->head;
+		from->head = (c == from->last) ? NULL : sort_unit_tail(data, c)->next;
+		sort_out_append(data, c);
+	}
+	from = data->a.head ? &data->a : &data->b;
+	data->out.tail->next = from->head;
+	data->out.last = from->last;
+	data->out.tail = from->tail;
+	data->out.len = x->len + y->len;
+	*x = data->out;
+	data->merging = 0;
+pop:
+	for (i = k + 1; i < data->nruns - 1; i++) {
+		data->runs[i] = data->runs[i + 1];
+	}
+	data->nruns--;
 }
 
-static VALUE
-list_select(VALUE self)
+static void
+sort_merge_collapse(struct sort_data *data)
+{
+	struct sort_run *r = data->runs;
+	int k;
+
+	while (1 < data->nruns) {
+		k = data->nruns - 2;
+		if ((0 < k && r[k - 1].len <= r[k].len + r[k + 1].len) ||
+		    (1 < k && r[k - 2].len <= r[k - 1].len + r[k].len)) {
+			if (r[k - 1].len < r[k + 1].len) k--;
+		} else if (r[k + 1].len < r[k].len) {
+			break;
+		}
+		sort_merge_at(data, k);
+	}
+}
+
+static void
+sort_collect_keys(struct sort_data *data)
 {
-	VALUE result;
 	item_t *c;
 
-	RETURN_SIZED_ENUMERATOR(self, 0, 0, list_enum_length);
-	result = list_new();
-	LIST_FOR(self, c) {
-		if (RTEST(rb_yield(c->value))) {
-			list_push(result, c->value);
+	data->keys = ALLOC_N(struct radix_pair, data->len);
+	for (c = data->rest; c; c = c->next) {
+		data->keys[data->nkeys].item = c;
+		data->keys[data->nkeys].key = (uint64_t)Qnil;
+		data->nkeys++;
+		data->keys[data->nkeys - 1].key = (uint64_t)rb_yield(c->value);
+	}
+}
+
+/* put the key item after each item for the merge sort */
+static void
+sort_pair_keys(struct sort_data *data)
+{
+	item_t *k, *last;
+	long i;
+
+	k = item_alloc_chain(data->len, &last);
+	for (i = 0; i < data->len; i++) {
+		data->keys[i].item->next = k;
+		k->value = (VALUE)data->keys[i].key;
+		k = k->next;
+		data->keys[i].item->next->next = i + 1 < data->len ? data->keys[i + 1].item : NULL;
+	}
+	data->paired = 1;
+	data->nkeys = 0;
+	xfree(data->keys);
+	data->keys = NULL;
+}
+
+/*
+ * LSD radix sort for sort_by when every key is a Fixnum, or every key is
+ * a Float.  Keys are mapped to unsigned integers of the same order and the
+ * items are relinked into a single run.
+ */
+
+#define SORT_RADIX_MIN 64
+
+static inline uint64_t
+radix_float_key(double d)
+{
+	union { double d; uint64_t u; } x;
+
+	x.d = (d == 0.0) ? 0.0 : d;	/* -0.0 and 0.0 are equal keys */
+	return (x.u >> 63) ? ~x.u : x.u | ((uint64_t)1 << 63);
+}
+
+static int
+sort_radix(struct sort_data *data)
+{
+	struct radix_pair *src, *dst, *tmp;
+	long cnt[8][256];
+	long n = data->len, i, d, sum, t;
+	item_t *prev;
+	VALUE k;
+	int fix;
+
+	if (n < SORT_RADIX_MIN) return FALSE;
+	src = data->keys;
+	k = (VALUE)src[0].key;
+	fix = FIXNUM_P(k);
+	if (!fix && !RB_FLOAT_TYPE_P(k)) return FALSE;
+	for (i = 0; i < n; i++) {
+		k = (VALUE)src[i].key;
+		if (fix) {
+			if (!FIXNUM_P(k)) return FALSE;
+		} else if (!RB_FLOAT_TYPE_P(k) || isnan(RFLOAT_VALUE(k))) {
+			return FALSE;
 		}
 	}
-	return result;
+	if (!cmp_opt_basic_p(&data->opt, fix ? CMP_OPT_INTEGER : CMP_OPT_FLOAT, CLASS_OF(k), id_cmp)) {
+		return FALSE;
+	}
+
+	/* scratch half for the passes; the keys stay marked while it grows */
+	REALLOC_N(data->keys, struct radix_pair, n * 2);
+	src = data->keys;
+	/* no allocation from here on, so the keys need not stay marked */
+	data->nkeys = 0;
+	dst = src + n;
+	MEMZERO(cnt, long, 8 * 256);
+	for (i = 0; i < n; i++) {
+		k = (VALUE)src[i].key;
+		src[i].key = fix ? (uint64_t)FIX2LONG(k) ^ ((uint64_t)1 << 63)
+				 : radix_float_key(RFLOAT_VALUE(k));
+		for (d = 0; d < 8; d++) {
+			cnt[d][(src[i].key >> (d * 8)) & 0xff]++;
+		}
+	}
+	for (d = 0; d < 8; d++) {
+		if (cnt[d][(src[0].key >> (d * 8)) & 0xff] == n) continue;
+		for (sum = 0, i = 0; i < 256; i++) {
+			t = cnt[d][i];
+			cnt[d][i] = sum;
+			sum += t;
+		}
+		for (i = 0; i < n; i++) {
+			dst[cnt[d][(src[i].key >> (d * 8)) & 0xff]++] = src[i];
+		}
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	prev = src[0].item;
+	for (i = 1; i < n; i++) {
+		prev->next = src[i].item;
+		prev = src[i].item;
+	}
+	prev->next = NULL;
+
+	data->runs[0].head = src[0].item;
+	data->runs[0].last = prev;
+	data->runs[0].tail = prev;
+	data->runs[0].len = n;
+	data->nruns = 1;
+	data->rest = NULL;
+	return TRUE;
 }
 
 static VALUE
-list_select_bang(VALUE self)
+sort_i(VALUE arg)
 {
-	VALUE result;
+	struct sort_data *data = (struct sort_data *)arg;
+	struct sort_run run;
+	int k;
+
+	if (data->mode == SORT_BY) {
+		sort_collect_keys(data);
+		if (sort_radix(data)) return Qnil;
+		sort_pair_keys(data);
+	}
+	while (data->rest) {
+		sort_take_run(data, &run);
+		data->runs[data->nruns++] = run;
+		sort_merge_collapse(data);
+	}
+	while (1 < data->nruns) {
+		k = data->nruns - 2;
+		if (0 < k && data->runs[k - 1].len < data->runs[k + 1].len) k--;
+		sort_merge_at(data, k);
+	}
+	return Qnil;
+}
+
+static inline void
+sort_chain_append(struct sort_run *chain, item_t *head, item_t *tail)
+{
+	if (head == NULL) return;
+	if (chain->head) {
+		chain->tail->next = head;
+	} else {
+		chain->head = head;
+	}
+	chain->tail = tail;
+}
+
+/* unlink and free the key item following each item of the chain */
+static void
+sort_drop_keys(struct sort_run *chain)
+{
+	item_t *c, *k;
+
+	for (c = chain->head; c; c = c->next) {
+		k = c->next;
+		c->next = k->next;
+		item_free(k);
+		chain->tail = c;
+	}
+}
+
+/*
+ * A failed merge! hands back what is left of the donor's run, found by
+ * its position.  Nothing records where the items of the merged prefix
+ * came from, so those stay in self.
+ */
+static void
+sort_give_back(struct sort_data *data)
+{
+	struct sort_run theirs;
+	list_t *optr = data->optr;
 	item_t *c;
-	long i = 0;
+	long n = 0, i;
+
+	if (data->merging) {
+		theirs = data->b;
+		data->b.head = NULL;
+	} else if (data->nruns == 2) {
+		theirs = data->runs[1];
+		data->nruns = 1;
+	} else {
+		/* still collecting keys: self's items, then the donor's */
+		c = data->rest;
+		for (i = 1; i < data->runs[0].len; i++) {
+			c = sort_unit_tail(data, c)->next;
+		}
+		c = sort_unit_tail(data, c);
+		theirs.head = c->next;
+		c->next = NULL;
+		for (c = theirs.head; c && c->next; c = c->next);
+		theirs.tail = c;
+	}
+	if (theirs.head == NULL) return;
+	theirs.tail->next = NULL;
+	if (data->paired) sort_drop_keys(&theirs);
+	for (c = theirs.head; c; c = c->next) {
+		theirs.tail = c;
+		n++;
+	}
+	theirs.tail->next = optr->first;
+	if (optr->first == NULL) optr->last = theirs.tail;
+	optr->first = theirs.head;
+	LIST_PTR_LEN(optr) += n;
+	data->len -= n;
+}
+
+/* give all pieces back to the list, dropping the key items */
+static VALUE
+sort_ensure(VALUE arg)
+{
+	struct sort_data *data = (struct sort_data *)arg;
+	list_t *ptr = data->ptr;
+	struct sort_run chain, *r;
+	item_t *c;
+	int i;
 
-	RETURN_SIZED_ENUMERATOR(self, 0, 0, list_enum_length);
-	result = list_new();
-	LIST_FOR(self, c) {
-		if (RTEST(rb_yield(c->value))) {
+	if (data->optr) {
+		sort_give_back(data);
+	}
+	chain.head = chain.tail = NULL;
+	for (i = 0; i < data->nruns; i++) {
+		if (data->merging && i == data->merge_at) {
+			sort_chain_append(&chain, data->out.head, data->out.tail);
+			sort_chain_append(&chain, data->a.head, data->a.tail);
+			sort_chain_append(&chain, data->b.head, data->b.tail);
 			i++;
-			list_push(result, c->value);
+			continue;
 		}
+		r = &data->runs[i];
+		sort_chain_append(&chain, r->head, r->tail);
+	}
+	if (data->rest) {
+		for (c = data->rest; c->next; c = c->next);
+		sort_chain_append(&chain, data->rest, c);
 	}
+	chain.tail->next = NULL;
 
-	if (i == LIST_LEN(self)) return Qnil;
-	return list_replace(self, result);
+	if (data->keys) xfree(data->keys);
+	if (data->paired) {
+		sort_drop_keys(&chain);
+	}
+	/* anything pushed meanwhile stays behind the sorted items */
+	chain.tail->next = ptr->first;
+	if (ptr->first == NULL) ptr->last = chain.tail;
+	ptr->first = chain.head;
+	LIST_PTR_LEN(ptr) += data->len;
+	return Qnil;
+}
+
+static void
+list_sort_chain(VALUE self, enum sort_mode mode)
+{
+	struct sort_data data;
+	volatile VALUE holder;
+	list_t *ptr = LIST_PTR(self);
+
+	if (LIST_PTR_LEN(ptr) <= 1) return;
+	MEMZERO(&data, struct sort_data, 1);
+	data.ptr = ptr;
+	data.mode = mode;
+	data.len = LIST_PTR_LEN(ptr);
+	holder = Data_Wrap_Struct(0, sort_mark, 0, &data);
+	data.rest = ptr->first;
+	ptr->first = ptr->last = NULL;
+	LIST_PTR_LEN(ptr) = 0;
+	rb_ensure(sort_i, (VALUE)&data, sort_ensure, (VALUE)&data);
+	DATA_PTR(holder) = NULL;
+	RB_GC_GUARD(holder);
 }
 
 static VALUE
-list_keep_if(VALUE self)
+list_sort_bang(VALUE self)
+{
+	list_modify_check(self);
+	list_sort_chain(self, rb_block_given_p() ? SORT_BLOCK : SORT_CMP);
+	return self;
+}
+
+static VALUE
+list_sort(VALUE self)
+{
+	VALUE result = list_make_shared_copy(self);
+
+	list_sort_chain(result, rb_block_given_p() ? SORT_BLOCK : SORT_CMP);
+	return result;
+}
+
+static VALUE
+list_sort_by_bang(VALUE self)
 {
 	RETURN_SIZED_ENUMERATOR(self, 0, 0, list_enum_length);
-	list_select_bang(self);
+	list_modify_check(self);
+	list_sort_chain(self, SORT_BY);
 	return self;
 }
 
 static VALUE
-list_values_at(int argc, VALUE *argv, VALUE self)
+list_sort_by(VALUE self)
 {
-	VALUE result = list_new();
-	long beg, len;
-	long i, j;
-	list_t *ptr;
+	VALUE result;
 
-	Data_Get_Struct(self, list_t, ptr);
-	for (i = 0; i < argc; i++) {
-		if (FIXNUM_P(argv[i])) {
-			list_push(result, list_entry(self, FIX2LONG(argv[i])));
-		} else if (rb_range_beg_len(argv[i], &beg, &len, LIST_LEN(self), 1)) {
-			for (j = beg; j < beg + len; j++) {
-				if (LIST_LEN(self) < j) {
-					list_push(result, Qnil);
-				} else {
-					list_push(result, list_elt(self, j));
-				}
-			}
-		} else {
-			list_push(result, list_entry(self, NUM2LONG(argv[i])));
-		}
-	}
+	RETURN_SIZED_ENUMERATOR(self, 0, 0, list_enum_length);
+	result = list_dup(self);
+	list_sort_chain(result, SORT_BY);
 	return result;
 }
 
+/* merge the two sorted runs of the chain, the first one being runs[0].len long */
 static VALUE
-list_delete(VALUE self, VALUE item)
+merge_i(VALUE arg)
 {
-	list_t *ptr;
-	item_t *c, *before = NULL, *next;
-	long len;
+	struct sort_data *data = (struct sort_data *)arg;
+	struct sort_run *x = &data->runs[0], *y = &data->runs[1];
+	item_t *c = data->rest;
+	long i;
+
+	if (data->mode == SORT_BY) {
+		sort_collect_keys(data);
+		sort_pair_keys(data);
+	}
+	x->head = c;
+	for (i = 1; i < x->len; i++) {
+		c = sort_unit_tail(data, c)->next;
+	}
+	x->last = c;
+	x->tail = sort_unit_tail(data, c);
+	y->head = x->tail->next;
+	y->len = data->len - x->len;
+	for (c = y->head, i = 1; i < y->len; i++) {
+		c = sort_unit_tail(data, c)->next;
+	}
+	y->last = c;
+	y->tail = sort_unit_tail(data, c);
+	data->nruns = 2;
+	data->rest = NULL;
+	sort_merge_at(data, 0);
+	data->optr = NULL;
+	return Qnil;
+}
+
+/* move the items of other into the sorted chain of self */
+static void
+list_merge_chain(VALUE self, VALUE other, enum sort_mode mode)
+{
+	struct sort_data data;
+	volatile VALUE holder;
+	list_t *ptr = LIST_PTR(self), *optr = LIST_PTR(other);
+
+	if (LIST_PTR_LEN(ptr) == 0 || LIST_PTR_LEN(optr) == 0) {
+		list_steal(self, other);
+		return;
+	}
+	MEMZERO(&data, struct sort_data, 1);
+	data.ptr = ptr;
+	data.mode = mode;
+	data.len = LIST_PTR_LEN(ptr) + LIST_PTR_LEN(optr);
+	data.runs[0].len = LIST_PTR_LEN(ptr);
+	data.optr = optr;
+	holder = Data_Wrap_Struct(0, sort_mark, 0, &data);
+
+	ptr->last->next = optr->first;
+	data.rest = ptr->first;
+	ptr->first = ptr->last = NULL;
+	LIST_PTR_LEN(ptr) = 0;
+	optr->first = optr->last = NULL;
+	LIST_PTR_LEN(optr) = 0;
+	rb_ensure(merge_i, (VALUE)&data, sort_ensure, (VALUE)&data);
+	DATA_PTR(holder) = NULL;
+	RB_GC_GUARD(holder);
+}
 
+static VALUE
+list_merge_bang(VALUE self, VALUE other)
+{
 	list_modify_check(self);
-	Data_Get_Struct(self, list_t, ptr);
-	if (LIST_LEN(self) == 0) return Qnil;
+	if (self == other) {
+		rb_raise(rb_eArgError, "cannot merge `List' into itself");
+	}
+	if (!rb_obj_is_kind_of(other, cList)) {
+		other = to_list(other);
+	}
+	list_modify_check(other);
+	list_merge_chain(self, other, rb_block_given_p() ? SORT_BY : SORT_CMP);
+	return self;
+}
 
-	len = LIST_LEN(self);
-	for (c = ptr->first; c; c = next) {
-		next = c->next;
-		if (rb_equal(c->value, item)) {
-			if (ptr->first == ptr->last) {
-				ptr->first = NULL;
-				ptr->last = NULL;
-			} else if (c == ptr->first) {
-				ptr->first = c->next;
-			} else if (c == ptr->last) {
-				ptr->last = before;
-				ptr->last->next = NULL;
-			} else {
-				before->next = c->next;
-			}
-			xfree(c);
-			LIST_LEN(self)--;
+static VALUE
+list_merge(VALUE self, VALUE other)
+{
+	VALUE result = list_make_shared_copy(self);
+	VALUE tmp;
+
+	if (TYPE(other) == T_ARRAY) {
+		tmp = to_list(other);
+	} else {
+		tmp = list_dup(to_list(other));
+	}
+	list_merge_chain(result, tmp, rb_block_given_p() ? SORT_BY : SORT_CMP);
+	return result;
+}
+
+/* k-way merge for List.merge_all: a heap of the heads of the sources */
+
+struct kmerge_entry {
+	VALUE key;
+	item_t *c;
+	long src;
+};
+
+struct kmerge {
+	struct kmerge_entry *heap;
+	long len;
+	VALUE last_key;
+	int by;
+	struct cmp_opt opt;
+};
+
+static void
+kmerge_mark(struct kmerge *m)
+{
+	long i;
+
+	for (i = 0; i < m->len; i++) {
+		rb_gc_mark(m->heap[i].key);
+	}
+	rb_gc_mark(m->last_key);
+}
+
+static void
+kmerge_free(struct kmerge *m)
+{
+	xfree(m->heap);
+	xfree(m);
+}
+
+static int
+kmerge_key_cmp(struct kmerge *m, VALUE a, VALUE b)
+{
+	int r;
+
+	if (!optimized_cmp(&m->opt, a, b, &r)) {
+		r = rb_cmpint(rb_funcall(a, id_cmp, 1, b), a, b);
+	}
+	return r;
+}
+
+static int
+kmerge_cmp(struct kmerge *m, struct kmerge_entry *x, struct kmerge_entry *y)
+{
+	int r = kmerge_key_cmp(m, x->key, y->key);
+
+	if (r == 0) {
+		r = (x->src > y->src) - (x->src < y->src);
+	}
+	return r;
+}
+
+static void
+kmerge_sift_down(struct kmerge *m, long i)
+{
+	struct kmerge_entry e;
+	long l, s;
+
+	while ((l = 2 * i + 1) < m->len) {
+		s = i;
+		if (kmerge_cmp(m, &m->heap[l], &m->heap[s]) < 0) s = l;
+		if (l + 1 < m->len && kmerge_cmp(m, &m->heap[l + 1], &m->heap[s]) < 0) s = l + 1;
+		if (s == i) break;
+		e = m->heap[i];
+		m->heap[i] = m->heap[s];
+		m->heap[s] = e;
+		i = s;
+	}
+}
+
+static inline VALUE
+kmerge_key(struct kmerge *m, item_t *c)
+{
+	return m->by ? rb_yield(c->value) : c->value;
+}
+
+/*
+ * The heap points into the source chains while the key block and <=> run,
+ * so each source which is not frozen is detached into a hidden List for
+ * the merge, and handed back afterwards.  Meanwhile the sources look empty.
+ */
+struct kmerge_arg {
+	struct kmerge *m;
+	VALUE srcs;
+	VALUE walked;	/* what is walked for each source */
+	VALUE result;
+	int uniq;
+};
+
+static VALUE
+kmerge_i(VALUE a)
+{
+	struct kmerge_arg *arg = (struct kmerge_arg *)a;
+	struct kmerge *m = arg->m;
+	item_t *c;
+	long i, k = RARRAY_LEN(arg->walked);
+	int emitted = 0;
+
+	for (i = 0; i < k; i++) {
+		c = LIST_RAW_PTR(RARRAY_AREF(arg->walked, i))->first;
+		if (c == NULL) continue;
+		m->heap[m->len].key = Qnil;
+		m->heap[m->len].c = c;
+		m->heap[m->len].src = i;
+		m->len++;
+		m->heap[m->len - 1].key = kmerge_key(m, c);
+	}
+	for (i = m->len / 2 - 1; 0 <= i; i--) {
+		kmerge_sift_down(m, i);
+	}
+
+	while (0 < m->len) {
+		c = m->heap[0].c;
+		if (!arg->uniq || !emitted || kmerge_key_cmp(m, m->heap[0].key, m->last_key) != 0) {
+			list_push_item(arg->result, c->value);
+			emitted = 1;
+		}
+		m->last_key = m->heap[0].key;
+		if (c->next) {
+			m->heap[0].c = c->next;
+			m->heap[0].key = kmerge_key(m, c->next);
 		} else {
-			before = c;
+			m->heap[0] = m->heap[--m->len];
 		}
+		kmerge_sift_down(m, 0);
 	}
+	return Qnil;
+}
 
-	if (LIST_LEN(self) == len) {
-		if (rb_block_given_p()) {
-			return rb_yield(item);
+/* detached items go back in front of anything the block pushed; a List
+ * given twice gets its chain once, as list_prepend_raw empties tmp */
+static VALUE
+kmerge_ensure(VALUE a)
+{
+	struct kmerge_arg *arg = (struct kmerge_arg *)a;
+	VALUE src, tmp;
+	long i;
+
+	arg->m->len = 0;
+	for (i = 0; i < RARRAY_LEN(arg->srcs); i++) {
+		src = RARRAY_AREF(arg->srcs, i);
+		tmp = RARRAY_AREF(arg->walked, i);
+		if (src != tmp) {
+			list_prepend_raw(LIST_RAW_PTR(src), LIST_RAW_PTR(tmp));
 		}
-		return Qnil;
-	} else {
-		return item;
 	}
+	return Qnil;
 }
 
 static VALUE
-list_delete_at(VALUE self, long pos)
+list_s_merge_all(int argc, VALUE *argv, VALUE klass)
+{
+	struct kmerge_arg arg;
+	struct kmerge *m;
+	volatile VALUE holder, srcs, walked;
+	VALUE lists, opts, src, tmp, detached;
+	long i, k;
+	int uniq = 0;
+
+	rb_scan_args(argc, argv, "1:", &lists, &opts);
+	if (!NIL_P(opts)) uniq = RTEST(rb_hash_aref(opts, ID2SYM(id_uniq)));
+	lists = rb_convert_type(lists, T_ARRAY, "Array", "to_a");
+	k = RARRAY_LEN(lists);
+	srcs = rb_ary_new2(k);
+	for (i = 0; i < k; i++) {
+		src = rb_ary_entry(lists, i);
+		if (!rb_obj_is_kind_of(src, cList)) {
+			src = to_list(src);
+		}
+		LIST_PTR(src);	/* fills a lazy List */
+		rb_ary_push(srcs, src);
+	}
+
+	/* a List given twice is detached once */
+	detached = rb_hash_new();
+	rb_funcall(detached, rb_intern("compare_by_identity"), 0);
+	walked = rb_ary_new2(k);
+	for (i = 0; i < k; i++) {
+		src = RARRAY_AREF(srcs, i);
+		if (OBJ_FROZEN(src)) {
+			tmp = src;
+		} else {
+			tmp = rb_hash_lookup2(detached, src, Qundef);
+			if (tmp == Qundef) {
+				tmp = list_detach(src, 0, LIST_LEN(src));
+				rb_hash_aset(detached, src, tmp);
+			}
+		}
+		rb_ary_push(walked, tmp);
+	}
+
+	m = ALLOC(struct kmerge);
+	MEMZERO(m, struct kmerge, 1);
+	m->last_key = Qnil;
+	holder = Data_Wrap_Struct(0, kmerge_mark, kmerge_free, m);
+	m->heap = ALLOC_N(struct kmerge_entry, 0 < k ? k : 1);
+	m->by = rb_block_given_p();
+	arg.m = m;
+	arg.srcs = srcs;
+	arg.walked = walked;
+	arg.result = rb_obj_alloc(klass);
+	arg.uniq = uniq;
+	rb_ensure(kmerge_i, (VALUE)&arg, kmerge_ensure, (VALUE)&arg);
+	RB_GC_GUARD(holder);
+	RB_GC_GUARD(srcs);
+	RB_GC_GUARD(walked);
+	return arg.result;
+}
+
+/* external merge sort: sorted runs are spilled to unlinked temp files as
+ * tagged records (see extsort_tag) and k-way merged back into the chain */
+
+#define EXTSORT_MEMORY_LIMIT (64 * 1024 * 1024)
+#define EXTSORT_SAMPLE 8
+#define EXTSORT_OBJECT_SIZE 64	/* guess for what the records can't tell */
+
+struct extsort_entry {
+	VALUE value;
+	long src;
+};
+
+struct extsort {
+	VALUE self;
+	VALUE run;
+	VALUE buf;
+	VALUE tmpdir;
+	FILE **files;
+	long nfiles;
+	long spilled;
+	long capa;
+	long limit;
+	struct extsort_entry *heap;
+	long len;
+	int merging;
+	int done;
+	int block;
+	struct cmp_opt opt;
+};
+
+static void
+extsort_mark(struct extsort *x)
 {
-	VALUE del;
-	list_t *ptr;
-	item_t *c, *before = NULL, *next;
-	long len, i = 0;
+	long i;
 
-	Data_Get_Struct(self, list_t, ptr);
-	len = LIST_LEN(self);
-	if (LIST_LEN(self) == 0) return Qnil;
-	if (pos < 0) {
-		pos += len;
-		if (pos < 0) return Qnil;
+	rb_gc_mark(x->self);
+	rb_gc_mark(x->run);
+	rb_gc_mark(x->buf);
+	rb_gc_mark(x->tmpdir);
+	for (i = 0; i < x->len; i++) {
+		rb_gc_mark(x->heap[i].value);
 	}
-	list_modify_check(self);
+}
 
-	for (c = ptr->first; c; c = next) {
-		next = c->next;
-		if (pos == i++) {
-			del = c->value;
-			if (ptr->first == ptr->last) {
-				ptr->first = NULL;
-				ptr->last = NULL;
-			} else if (c == ptr->first) {
-				ptr->first = c->next;
-			} else if (c == ptr->last) {
-				ptr->last = before;
-				ptr->last->next = NULL;
-			} else {
-				before->next = c->next;
+static void
+extsort_close(struct extsort *x)
+{
+	long i;
+
+	for (i = 0; i < x->nfiles; i++) {
+		if (x->files[i]) fclose(x->files[i]);
+		x->files[i] = NULL;
+	}
+}
+
+static void
+extsort_free(struct extsort *x)
+{
+	extsort_close(x);
+	xfree(x->files);
+	xfree(x->heap);
+	xfree(x);
+}
+
+static FILE *
+extsort_tmpfile(struct extsort *x)
+{
+#ifdef HAVE_MKSTEMP
+	VALUE path = rb_sprintf("%"PRIsVALUE"/list-sort-XXXXXX", x->tmpdir);
+	char *name = StringValueCStr(path);
+	FILE *f;
+	int fd;
+
+	if (x->nfiles == x->capa) {
+		x->capa = x->capa ? x->capa * 2 : 16;
+		REALLOC_N(x->files, FILE *, x->capa);
+	}
+	fd = mkstemp(name);
+	if (fd < 0) rb_sys_fail(name);
+	unlink(name);
+	f = fdopen(fd, "w+b");
+	if (f == NULL) {
+		close(fd);
+		rb_sys_fail(name);
+	}
+	x->files[x->nfiles++] = f;
+	return f;
+#else
+	rb_notimplement();
+	return NULL;
+#endif
+}
+
+/* records: a tag byte, then a zigzag varint for Fixnums, the raw double
+ * for Floats, encoding and bytes for plain Strings and a Marshal dump for
+ * anything else */
+enum extsort_tag {
+	EXT_FIXNUM,
+	EXT_FLOAT,
+	EXT_STRING,
+	EXT_MARSHAL
+};
+
+static inline int
+extsort_put_varint(unsigned char *p, unsigned long n)
+{
+	int h = 0;
+
+	do {
+		p[h++] = (n & 0x7f) | (n > 0x7f ? 0x80 : 0);
+		n >>= 7;
+	} while (n);
+	return h;
+}
+
+static unsigned long
+extsort_get_varint(FILE *f)
+{
+	unsigned long n = 0;
+	int ch, shift = 0;
+
+	do {
+		if ((ch = getc(f)) == EOF) {
+			rb_raise(rb_eIOError, "truncated sort run");
+		}
+		n |= (unsigned long)(ch & 0x7f) << shift;
+		shift += 7;
+	} while (ch & 0x80);
+	return n;
+}
+
+static long
+extsort_write(FILE *f, VALUE obj)
+{
+	unsigned char hdr[1 + 2 * 10];
+	VALUE s = Qnil;
+	long h = 1, n;
+	double d;
+
+	if (FIXNUM_P(obj)) {
+		n = FIX2LONG(obj);
+		hdr[0] = EXT_FIXNUM;
+		h += extsort_put_varint(hdr + 1, ((unsigned long)n << 1) ^ (unsigned long)(n >> (sizeof(long) * CHAR_BIT - 1)));
+	} else if (RB_FLOAT_TYPE_P(obj)) {
+		d = RFLOAT_VALUE(obj);
+		hdr[0] = EXT_FLOAT;
+		memcpy(hdr + 1, &d, sizeof(d));
+		h += sizeof(d);
+	} else if (RB_TYPE_P(obj, T_STRING) && RBASIC_CLASS(obj) == rb_cString &&
+		   rb_ivar_count(obj) == 0) {
+		s = obj;
+		hdr[0] = EXT_STRING;
+		h += extsort_put_varint(hdr + h, rb_enc_get_index(s));
+		h += extsort_put_varint(hdr + h, RSTRING_LEN(s));
+	} else {
+		s = rb_marshal_dump(obj, Qnil);
+		hdr[0] = EXT_MARSHAL;
+		h += extsort_put_varint(hdr + h, RSTRING_LEN(s));
+	}
+	if (fwrite(hdr, 1, h, f) != (size_t)h) rb_sys_fail("write");
+	if (NIL_P(s)) return h;
+	if (fwrite(RSTRING_PTR(s), 1, RSTRING_LEN(s), f) != (size_t)RSTRING_LEN(s)) {
+		rb_sys_fail("write");
+	}
+	return h + RSTRING_LEN(s);
+}
+
+/* rough record size, without Marshal: items which can't be dumped
+ * only fail when they actually have to be spilled */
+static long
+extsort_size(VALUE obj)
+{
+	if (FIXNUM_P(obj)) return 1 + sizeof(long);
+	if (RB_FLOAT_TYPE_P(obj)) return 1 + sizeof(double);
+	if (RB_TYPE_P(obj, T_STRING)) return 3 + RSTRING_LEN(obj);
+	if (RB_TYPE_P(obj, T_ARRAY)) return 2 + RARRAY_LEN(obj) * sizeof(VALUE);
+	return EXTSORT_OBJECT_SIZE;
+}
+
+/* Qundef at the end of the run */
+static VALUE
+extsort_read(struct extsort *x, long i)
+{
+	FILE *f = x->files[i];
+	unsigned long n, u;
+	int tag, enc = 0;
+	double d;
+	VALUE s;
+
+	if (f == NULL) return Qundef;
+	if ((tag = getc(f)) == EOF) {
+		if (ferror(f)) rb_sys_fail("read");
+		fclose(f);
+		x->files[i] = NULL;
+		return Qundef;
+	}
+	switch (tag) {
+	case EXT_FIXNUM:
+		u = extsort_get_varint(f);
+		return LONG2FIX((long)(u >> 1) ^ -(long)(u & 1));
+	case EXT_FLOAT:
+		if (fread(&d, 1, sizeof(d), f) != sizeof(d)) break;
+		return DBL2NUM(d);
+	case EXT_STRING:
+		enc = (int)extsort_get_varint(f);
+		/* fall through */
+	case EXT_MARSHAL:
+		n = extsort_get_varint(f);
+		s = tag == EXT_STRING ? rb_str_new(0, n) : rb_str_resize(x->buf, n);
+		if (fread(RSTRING_PTR(s), 1, n, f) != n) break;
+		if (tag == EXT_MARSHAL) return rb_marshal_load(s);
+		rb_enc_associate_index(s, enc);
+		return s;
+	}
+	rb_raise(rb_eIOError, "truncated sort run");
+	return Qnil;
+}
+
+static int
+extsort_cmp(struct extsort *x, struct extsort_entry *a, struct extsort_entry *b)
+{
+	int r;
+
+	if (x->block) {
+		r = rb_cmpint(rb_yield_values(2, a->value, b->value), a->value, b->value);
+	} else if (!optimized_cmp(&x->opt, a->value, b->value, &r)) {
+		r = rb_cmpint(rb_funcall(a->value, id_cmp, 1, b->value), a->value, b->value);
+	}
+	if (r == 0) {
+		r = (a->src > b->src) - (a->src < b->src);
+	}
+	return r;
+}
+
+static void
+extsort_sift_down(struct extsort *x, long i)
+{
+	struct extsort_entry e;
+	long l, s;
+
+	while ((l = 2 * i + 1) < x->len) {
+		s = i;
+		if (extsort_cmp(x, &x->heap[l], &x->heap[s]) < 0) s = l;
+		if (l + 1 < x->len && extsort_cmp(x, &x->heap[l + 1], &x->heap[s]) < 0) s = l + 1;
+		if (s == i) break;
+		e = x->heap[i];
+		x->heap[i] = x->heap[s];
+		x->heap[s] = e;
+		i = s;
+	}
+}
+
+static VALUE
+extsort_i(VALUE arg)
+{
+	struct extsort *x = (struct extsort *)arg;
+	long avg = 0, n, i, bytes;
+	list_t *ptr = LIST_PTR(x->self);
+	item_t *c;
+	FILE *f;
+	VALUE v;
+
+	for (c = ptr->first, i = 0; c && i < EXTSORT_SAMPLE; c = c->next, i++) {
+		avg += extsort_size(c->value);
+	}
+	avg = i ? avg / i + 1 : 1;
+	if (LIST_PTR_LEN(ptr) <= x->limit / avg) {
+		list_sort_chain(x->self, x->block ? SORT_BLOCK : SORT_CMP);
+		x->done = 1;
+		return Qnil;
+	}
+
+	while (0 < LIST_LEN(x->self)) {
+		n = x->limit / avg;
+		if (n < 1) n = 1;
+		if (LIST_LEN(x->self) < n) n = LIST_LEN(x->self);
+		x->run = list_detach(x->self, 0, n);
+		list_sort_chain(x->run, x->block ? SORT_BLOCK : SORT_CMP);
+		f = extsort_tmpfile(x);
+		bytes = 0;
+		LIST_FOR(x->run, c) {
+			bytes += extsort_write(f, c->value);
+		}
+		if (fflush(f) != 0) rb_sys_fail("write");
+		rewind(f);
+		avg = (avg + bytes / n) / 2 + 1;
+		list_clear(x->run);
+		x->run = Qnil;
+		x->spilled++;
+	}
+
+	x->merging = 1;
+	x->heap = ALLOC_N(struct extsort_entry, x->nfiles);
+	for (i = 0; i < x->nfiles; i++) {
+		v = extsort_read(x, i);
+		if (v == Qundef) continue;
+		x->heap[x->len].value = v;
+		x->heap[x->len].src = i;
+		x->len++;
+	}
+	for (i = x->len / 2 - 1; 0 <= i; i--) {
+		extsort_sift_down(x, i);
+	}
+	while (0 < x->len) {
+		list_push_item(x->self, x->heap[0].value);
+		v = extsort_read(x, x->heap[0].src);
+		if (v == Qundef) {
+			x->heap[0] = x->heap[--x->len];
+		} else {
+			x->heap[0].value = v;
+		}
+		extsort_sift_down(x, 0);
+	}
+	x->done = 1;
+	return Qnil;
+}
+
+/* on error put every spilled item back so that nothing is lost */
+static VALUE
+extsort_ensure(VALUE arg)
+{
+	struct extsort *x = (struct extsort *)arg;
+	VALUE rest, v;
+	long i;
+
+	if (!x->done) {
+		rest = list_new();
+		if (x->merging) {
+			for (i = 0; i < x->len; i++) {
+				list_push_item(rest, x->heap[i].value);
 			}
-			xfree(c);
-			LIST_LEN(self)--;
-			break;
+			x->len = 0;
+		} else {
+			list_steal(rest, x->self);
+		}
+		for (i = 0; i < x->spilled; i++) {
+			if (x->files[i] && !x->merging) rewind(x->files[i]);
+			while ((v = extsort_read(x, i)) != Qundef) {
+				list_push_item(x->merging ? rest : x->self, v);
+			}
+		}
+		if (!NIL_P(x->run)) list_steal(x->self, x->run);
+		list_steal(x->self, rest);
+	}
+	extsort_close(x);
+	return Qnil;
+}
+
+static VALUE
+list_sort_external_bang(int argc, VALUE *argv, VALUE self)
+{
+	struct extsort *x;
+	volatile VALUE holder;
+	VALUE opts, v, limit = LONG2FIX(EXTSORT_MEMORY_LIMIT), tmpdir = Qnil;
+	const char *dir;
+
+	rb_scan_args(argc, argv, ":", &opts);
+	if (!NIL_P(opts)) {
+		v = rb_hash_aref(opts, ID2SYM(id_memory_limit));
+		if (!NIL_P(v)) limit = v;
+		tmpdir = rb_hash_aref(opts, ID2SYM(id_tmpdir));
+	}
+	if (NUM2LONG(limit) <= 0) {
+		rb_raise(rb_eArgError, "memory_limit must be positive");
+	}
+	if (NIL_P(tmpdir)) {
+		dir = getenv("TMPDIR");
+		tmpdir = rb_str_new_cstr(dir && *dir ? dir : "/tmp");
+	} else {
+		FilePathValue(tmpdir);
+	}
+	list_modify_check(self);
+	if (LIST_LEN(self) <= 1) return self;
+
+	x = ALLOC(struct extsort);
+	MEMZERO(x, struct extsort, 1);
+	x->self = self;
+	x->run = Qnil;
+	x->buf = Qnil;
+	x->tmpdir = tmpdir;
+	x->limit = NUM2LONG(limit);
+	x->block = rb_block_given_p();
+	holder = Data_Wrap_Struct(0, extsort_mark, extsort_free, x);
+	x->buf = rb_str_buf_new(0);
+	rb_ensure(extsort_i, (VALUE)x, extsort_ensure, (VALUE)x);
+	RB_GC_GUARD(holder);
+	return self;
+}
+
+static VALUE
+list_collect_bang(VALUE self)
+{
+	item_t *c;
+
+	RETURN_SIZED_ENUMERATOR(self, 0, 0, list_enum_length);
+	LIST_FOR(self, c) {
+		c->value = rb_yield(c->value);
+	}
+	return self;
+}
+
+static VALUE
+list_collect(VALUE self)
+{
+	return list_collect_bang(rb_obj_clone(self));
+}
+
+static VALUE
+list_select(VALUE self)
+{
+	VALUE result;
+	item_t *c;
+
+	RETURN_SIZED_ENUMERATOR(self, 0, 0, list_enum_length);
+	result = list_new();
+	LIST_FOR(self, c) {
+		if (RTEST(rb_yield(c->value))) {
+			list_push(result, c->value);
+		}
+	}
+	return result;
+}
+
+/* move the first item of src to the tail of dst */
+static inline void
+list_move_first(list_t *src, list_t *dst)
+{
+	item_t *c = src->first;
+
+	src->first = c->next;
+	if (src->first == NULL) {
+		src->last = NULL;
+	}
+	LIST_PTR_LEN(src)--;
+	c->next = NULL;
+	if (dst->first == NULL) {
+		dst->first = c;
+	} else {
+		dst->last->next = c;
+	}
+	dst->last = c;
+	LIST_PTR_LEN(dst)++;
+}
+
+static inline void
+list_moving_check(VALUE self, item_t *c)
+{
+	rb_check_frozen(self);
+	if (LIST_RAW_PTR(self)->first != c) {
+		rb_raise(rb_eRuntimeError, "list modified during iteration");
+	}
+}
+
+/* drop the items keep() refuses, taking them off the head one by one so
+ * that a callback changing the list is caught by list_moving_check */
+struct filter_arg {
+	VALUE self;
+	VALUE kept;
+	int (*keep)(VALUE, void *);
+	void *data;
+};
+
+static VALUE
+filter_i(VALUE a)
+{
+	struct filter_arg *arg = (struct filter_arg *)a;
+	list_t *ptr = LIST_PTR(arg->self);
+	item_t *c;
+	int keep;
+
+	while ((c = ptr->first) != NULL) {
+		keep = arg->keep(c->value, arg->data);
+		list_moving_check(arg->self, c);
+		if (keep) {
+			list_move_first(ptr, LIST_RAW_PTR(arg->kept));
+		} else {
+			list_unlink(ptr, NULL, c);
+		}
+	}
+	return Qnil;
+}
+
+/* put the kept items back in front of whatever was not visited */
+static VALUE
+filter_ensure(VALUE a)
+{
+	struct filter_arg *arg = (struct filter_arg *)a;
+
+	list_prepend_raw(LIST_RAW_PTR(arg->self), LIST_RAW_PTR(arg->kept));
+	return Qnil;
+}
+
+/* TRUE when some item was dropped */
+static int
+list_filter_bang(VALUE self, int (*keep)(VALUE, void *), void *data)
+{
+	struct filter_arg arg;
+	long len;
+
+	list_modify_check(self);
+	len = LIST_LEN(self);
+	arg.self = self;
+	arg.kept = list_new();
+	arg.keep = keep;
+	arg.data = data;
+	rb_ensure(filter_i, (VALUE)&arg, filter_ensure, (VALUE)&arg);
+	RB_GC_GUARD(arg.kept);
+	return LIST_LEN(self) != len;
+}
+
+static int
+select_keep(VALUE v, void *data)
+{
+	return RTEST(rb_yield(v));
+}
+
+static VALUE
+list_select_bang(VALUE self)
+{
+	RETURN_SIZED_ENUMERATOR(self, 0, 0, list_enum_length);
+	if (!list_filter_bang(self, select_keep, NULL)) return Qnil;
+	return self;
+}
+
+static VALUE
+list_keep_if(VALUE self)
+{
+	RETURN_SIZED_ENUMERATOR(self, 0, 0, list_enum_length);
+	list_select_bang(self);
+	return self;
+}
+
+static VALUE
+list_values_at(int argc, VALUE *argv, VALUE self)
+{
+	VALUE result = list_new();
+	long beg, len;
+	long i, j;
+	list_t *ptr;
+
+	Data_Get_Struct(self, list_t, ptr);
+	for (i = 0; i < argc; i++) {
+		if (FIXNUM_P(argv[i])) {
+			list_push(result, list_entry(self, FIX2LONG(argv[i])));
+		} else if (rb_range_beg_len(argv[i], &beg, &len, LIST_LEN(self), 1)) {
+			for (j = beg; j < beg + len; j++) {
+				if (LIST_LEN(self) < j) {
+					list_push(result, Qnil);
+				} else {
+					list_push(result, list_elt(self, j));
+				}
+			}
+		} else {
+			list_push(result, list_entry(self, NUM2LONG(argv[i])));
+		}
+	}
+	return result;
+}
+
+static VALUE
+list_delete(VALUE self, VALUE item)
+{
+	struct cmp_opt opt = CMP_OPT_INIT;
+	list_t *ptr;
+	item_t *c, *before = NULL, *next;
+	long len;
+
+	list_modify_check(self);
+	Data_Get_Struct(self, list_t, ptr);
+	if (LIST_LEN(self) == 0) return Qnil;
+
+	len = LIST_LEN(self);
+	for (c = ptr->first; c; c = next) {
+		next = c->next;
+		if (optimized_equal(&opt, c->value, item)) {
+			list_unlink(ptr, before, c);
 		} else {
 			before = c;
 		}
 	}
 
-	if (LIST_LEN(self) == len) {
-		return Qnil;
-	} else {
-		return del;
+	if (LIST_LEN(self) == len) {
+		if (rb_block_given_p()) {
+			return rb_yield(item);
+		}
+		return Qnil;
+	} else {
+		return item;
+	}
+}
+
+static VALUE
+list_delete_at(VALUE self, long pos)
+{
+	VALUE del;
+	list_t *ptr;
+	item_t *c, *before = NULL, *next;
+	long len, i = 0;
+
+	Data_Get_Struct(self, list_t, ptr);
+	len = LIST_LEN(self);
+	if (LIST_LEN(self) == 0) return Qnil;
+	if (pos < 0) {
+		pos += len;
+		if (pos < 0) return Qnil;
+	}
+	list_modify_check(self);
+
+	for (c = ptr->first; c; c = next) {
+		next = c->next;
+		if (pos == i++) {
+			del = c->value;
+			list_unlink(ptr, before, c);
+			break;
+		} else {
+			before = c;
+		}
+	}
+
+	if (LIST_LEN(self) == len) {
+		return Qnil;
+	} else {
+		return del;
+	}
+}
+
+static VALUE
+list_delete_at_m(VALUE self, VALUE pos)
+{
+	return list_delete_at(self, NUM2LONG(pos));
+}
+
+static VALUE
+reject(VALUE self, VALUE result)
+{
+	item_t *c;
+
+	LIST_FOR(self, c) {
+		if (!RTEST(rb_yield(c->value))) {
+			list_push(result, c->value);
+		}
+	}
+	return result;
+}
+
+static VALUE
+reject_bang(VALUE self)
+{
+	list_t *ptr;
+	item_t *c, *before = NULL, *next;
+	long len;
+
+	list_modify_check(self);
+	Data_Get_Struct(self, list_t, ptr);
+	len = LIST_LEN(self);
+	for (c = ptr->first; c; c = next) {
+		next = c->next;
+		if (RTEST(rb_yield(c->value))) {
+			rb_check_frozen(self);
+			list_unlink(ptr, before, c);
+		} else {
+			before = c;
+		}
+	}
+
+	if (LIST_LEN(self) == len) {
+		return Qnil;
+	} else {
+		return self;
+	}
+}
+
+static VALUE
+list_reject_bang(VALUE self)
+{
+	RETURN_SIZED_ENUMERATOR(self, 0, 0, list_enum_length);
+	return reject_bang(self);
+}
+
+static VALUE
+list_reject(VALUE self)
+{
+	VALUE rejected_list;
+
+	RETURN_SIZED_ENUMERATOR(self, 0, 0, list_enum_length);
+	rejected_list = list_new();
+	reject(self, rejected_list);
+	return rejected_list;
+}
+
+static VALUE
+list_delete_if(VALUE self)
+{
+	RETURN_SIZED_ENUMERATOR(self, 0, 0, list_enum_length);
+	list_reject_bang(self);
+	return self;
+}
+
+/* partition!, group_by! and slice_when! move each visited item to the
+ * tail of one of the Lists in buckets */
+struct split_arg {
+	VALUE self;
+	VALUE buckets;
+	VALUE hash;
+	int done;
+};
+
+static VALUE
+partition_i(VALUE a)
+{
+	struct split_arg *arg = (struct split_arg *)a;
+	list_t *ptr = LIST_PTR(arg->self);
+	item_t *c;
+	VALUE v;
+
+	while ((c = ptr->first) != NULL) {
+		v = rb_yield(c->value);
+		list_moving_check(arg->self, c);
+		list_move_first(ptr, LIST_RAW_PTR(RARRAY_AREF(arg->buckets, RTEST(v) ? 0 : 1)));
+	}
+	arg->done = TRUE;
+	return Qnil;
+}
+
+static VALUE
+group_by_i(VALUE a)
+{
+	struct split_arg *arg = (struct split_arg *)a;
+	list_t *ptr = LIST_PTR(arg->self);
+	item_t *c;
+	VALUE k, group;
+
+	while ((c = ptr->first) != NULL) {
+		k = rb_yield(c->value);
+		list_moving_check(arg->self, c);
+		group = rb_hash_lookup2(arg->hash, k, Qundef);
+		if (group == Qundef) {
+			group = list_new();
+			rb_ary_push(arg->buckets, group);
+			rb_hash_aset(arg->hash, k, group);
+		}
+		list_move_first(ptr, LIST_RAW_PTR(group));
+	}
+	arg->done = TRUE;
+	return Qnil;
+}
+
+static VALUE
+slice_when_i(VALUE a)
+{
+	struct split_arg *arg = (struct split_arg *)a;
+	list_t *ptr = LIST_PTR(arg->self), *sptr;
+	item_t *c;
+	VALUE slice, v;
+
+	slice = list_new();
+	sptr = LIST_RAW_PTR(slice);
+	rb_ary_push(arg->buckets, slice);
+	list_move_first(ptr, sptr);
+	while ((c = ptr->first) != NULL) {
+		v = rb_yield_values(2, sptr->last->value, c->value);
+		list_moving_check(arg->self, c);
+		if (RTEST(v)) {
+			slice = list_new();
+			sptr = LIST_RAW_PTR(slice);
+			rb_ary_push(arg->buckets, slice);
+		}
+		list_move_first(ptr, sptr);
+	}
+	arg->done = TRUE;
+	return Qnil;
+}
+
+/* when the block breaks or raises, the visited items go back in front of
+ * the rest, bucket by bucket */
+static VALUE
+split_ensure(VALUE a)
+{
+	struct split_arg *arg = (struct split_arg *)a;
+	list_t *ptr = LIST_RAW_PTR(arg->self);
+	long i;
+
+	if (arg->done) return Qnil;
+	for (i = RARRAY_LEN(arg->buckets) - 1; 0 <= i; i--) {
+		list_prepend_raw(ptr, LIST_RAW_PTR(RARRAY_AREF(arg->buckets, i)));
+	}
+	return Qnil;
+}
+
+static void
+list_split_bang(VALUE self, VALUE (*walk)(VALUE), struct split_arg *arg)
+{
+	list_modify_check(self);
+	arg->self = self;
+	arg->done = FALSE;
+	rb_ensure(walk, (VALUE)arg, split_ensure, (VALUE)arg);
+}
+
+static VALUE
+list_partition_bang(VALUE self)
+{
+	struct split_arg arg;
+
+	RETURN_SIZED_ENUMERATOR(self, 0, 0, list_enum_length);
+	arg.buckets = rb_assoc_new(list_new(), list_new());
+	arg.hash = Qnil;
+	list_split_bang(self, partition_i, &arg);
+	return arg.buckets;
+}
+
+static VALUE
+list_group_by_bang(VALUE self)
+{
+	struct split_arg arg;
+
+	RETURN_SIZED_ENUMERATOR(self, 0, 0, list_enum_length);
+	arg.buckets = rb_ary_new();
+	arg.hash = rb_hash_new();
+	list_split_bang(self, group_by_i, &arg);
+	RB_GC_GUARD(arg.buckets);
+	return arg.hash;
+}
+
+static VALUE
+list_slice_when_bang(VALUE self)
+{
+	struct split_arg arg;
+
+	rb_need_block();
+	arg.buckets = rb_ary_new();
+	arg.hash = Qnil;
+	if (LIST_LEN(self) == 0) {
+		list_modify_check(self);
+		return arg.buckets;
+	}
+	list_split_bang(self, slice_when_i, &arg);
+	return arg.buckets;
+}
+
+struct take_arg {
+	VALUE list;
+	long n;
+};
+
+static VALUE
+take_items_i(RB_BLOCK_CALL_FUNC_ARGLIST(i, a))
+{
+	struct take_arg *arg = (struct take_arg *)a;
+
+	collect_all(i, arg->list, argc, (VALUE *)argv);
+	if (LIST_LEN(arg->list) == arg->n) {
+		rb_iter_break();
+	}
+	return Qnil;
+}
+
+/* the source as an Array or a List, taking at most n items from #each */
+static VALUE
+zip_source(VALUE obj, long n)
+{
+	struct take_arg arg;
+	VALUE tmp;
+
+	if (rb_obj_is_kind_of(obj, cList)) return obj;
+	tmp = rb_check_array_type(obj);
+	if (!NIL_P(tmp)) return tmp;
+	if (!rb_respond_to(obj, id_each)) {
+		rb_raise(rb_eTypeError, "wrong argument type %"PRIsVALUE" (must respond to :each)",
+			 rb_obj_class(obj));
+	}
+	arg.list = list_new();
+	arg.n = n;
+	if (n == 0) return arg.list;
+	rb_block_call(obj, id_each, 0, 0, take_items_i, (VALUE)&arg);
+	return arg.list;
+}
+
+/* the j-th tuple; the List sources are walked by their cursors in cur */
+static VALUE
+zip_tuple(VALUE first, VALUE srcs, item_t **cur, long j)
+{
+	VALUE tuple, src;
+	long i, n = RARRAY_LEN(srcs);
+
+	tuple = rb_ary_new2(n + 1);
+	rb_ary_push(tuple, first);
+	for (i = 0; i < n; i++) {
+		src = RARRAY_AREF(srcs, i);
+		if (TYPE(src) == T_ARRAY) {
+			rb_ary_push(tuple, rb_ary_entry(src, j));
+		} else if (cur[i]) {
+			rb_ary_push(tuple, cur[i]->value);
+			cur[i] = cur[i]->next;
+		} else {
+			rb_ary_push(tuple, Qnil);
+		}
+	}
+	return tuple;
+}
+
+/*
+ * walk self and the sources in lockstep: Arrays by index, Lists by their
+ * chains.  The block may change self or a source List, so with a block
+ * the Lists are walked as Array snapshots instead.
+ */
+static VALUE
+list_zip(int argc, VALUE *argv, VALUE self)
+{
+	volatile VALUE srcs = rb_ary_new2(argc);
+	volatile VALUE ary;
+	VALUE result, src, buf;
+	item_t *c, **cur;
+	long i, j;
+
+	for (i = 0; i < argc; i++) {
+		rb_ary_push(srcs, zip_source(argv[i], LIST_LEN(self)));
+	}
+	if (rb_block_given_p()) {
+		for (i = 0; i < argc; i++) {
+			src = RARRAY_AREF(srcs, i);
+			if (TYPE(src) != T_ARRAY) {
+				rb_ary_store(srcs, i, list_to_a(src));
+			}
+		}
+		ary = list_to_a(self);
+		for (j = 0; j < RARRAY_LEN(ary); j++) {
+			rb_yield(zip_tuple(RARRAY_AREF(ary, j), srcs, NULL, j));
+		}
+		RB_GC_GUARD(srcs);
+		return Qnil;
+	}
+	cur = ALLOCV_N(item_t *, buf, argc);
+	for (i = 0; i < argc; i++) {
+		src = RARRAY_AREF(srcs, i);
+		cur[i] = TYPE(src) == T_ARRAY ? NULL : LIST_PTR(src)->first;
+	}
+	result = list_new();
+	j = 0;
+	LIST_FOR(self, c) {
+		list_push_item(result, zip_tuple(c->value, srcs, cur, j++));
+	}
+	ALLOCV_END(buf);
+	RB_GC_GUARD(srcs);
+	return result;
+}
+
+static VALUE
+list_transpose(VALUE self)
+{
+	volatile VALUE cols = Qnil;
+	VALUE result = list_new(), row, col;
+	item_t *c, *e;
+	long elen = -1, rlen, i;
+
+	LIST_FOR(self, c) {
+		row = c->value;
+		if (!rb_obj_is_kind_of(row, cList)) {
+			row = rb_convert_type(row, T_ARRAY, "Array", "to_ary");
+		}
+		rlen = TYPE(row) == T_ARRAY ? RARRAY_LEN(row) : LIST_LEN(row);
+		if (elen < 0) {
+			elen = rlen;
+			cols = rb_ary_new2(elen);
+			for (i = 0; i < elen; i++) {
+				rb_ary_push(cols, rb_ary_new2(LIST_LEN(self)));
+			}
+		} else if (rlen != elen) {
+			rb_raise(rb_eIndexError, "element size differs (%ld should be %ld)",
+				 rlen, elen);
+		}
+		if (TYPE(row) == T_ARRAY) {
+			for (i = 0; i < elen; i++) {
+				rb_ary_push(RARRAY_AREF(cols, i), RARRAY_AREF(row, i));
+			}
+		} else {
+			i = 0;
+			LIST_FOR(row, e) {
+				rb_ary_push(RARRAY_AREF(cols, i++), e->value);
+			}
+		}
+	}
+	for (i = 0; i < elen; i++) {
+		col = RARRAY_AREF(cols, i);
+		list_push_item(result, col);
+	}
+	RB_GC_GUARD(cols);
+	return result;
+}
+
+static VALUE
+list_fill(int argc, VALUE *argv, VALUE self)
+{
+	VALUE item, arg1, arg2;
+	long beg = 0, len = 0, end = 0;
+	long i;
+	int block_p = FALSE;
+	item_t *c;
+
+	list_modify_check(self);
+	if (rb_block_given_p()) {
+		block_p = TRUE;
+		rb_scan_args(argc, argv, "02", &arg1, &arg2);
+		argc += 1; /* hackish */
+	} else {
+		rb_scan_args(argc, argv, "12", &item, &arg1, &arg2);
+	}
+	switch (argc) {
+	case 1:
+		beg = 0;
+		len = LIST_LEN(self);
+		break;
+	case 2:
+		if (rb_range_beg_len(arg1, &beg, &len, LIST_LEN(self), 1)) {
+			break;
+		}
+		/* fall through */
+	case 3:
+		beg = NIL_P(arg1) ? 0 : NUM2LONG(arg1);
+		if (beg < 0) {
+			beg = LIST_LEN(self) + beg;
+			if (beg < 0) beg = 0;
+		}
+		len = NIL_P(arg2) ? LIST_LEN(self) - beg : NUM2LONG(arg2);
+		break;
+	}
+	if (len < 0) {
+		return self;
+	}
+	if (LIST_MAX_SIZE <= beg || LIST_MAX_SIZE - beg < len) {
+		rb_raise(rb_eArgError, "argument too big");
+	}
+	end = beg + len;
+	if (LIST_LEN(self) < end) {
+		list_push_fill(self, end - LIST_LEN(self), Qnil);
+	}
+
+	i = -1;
+	LIST_FOR(self, c) {
+		i++;
+		if (i < beg) continue;
+		if ((end - 1) < i) break;
+		if (block_p) {
+			c->value = rb_yield(LONG2NUM(i));
+		} else {
+			c->value = item;
+		}
+	}
+	return self;
+}
+
+static VALUE
+list_include_p(VALUE self, VALUE item)
+{
+	struct cmp_opt opt = CMP_OPT_INIT;
+	item_t *c;
+
+	LIST_FOR(self, c) {
+		if (optimized_equal(&opt, c->value, item)) {
+			return Qtrue;
+		}
+	}
+	return Qfalse;
+}
+
+static VALUE
+recursive_cmp(VALUE list1, VALUE list2, int recur)
+{
+	struct cmp_opt opt = CMP_OPT_INIT;
+	item_t *c1, *c2;
+	long len;
+	int r;
+
+	if (recur) return Qundef;
+	len = LIST_LEN(list1);
+	if (LIST_LEN(list2) < len) {
+		len = LIST_LEN(list2);
+	}
+	LIST_FOR_DOUBLE(list1,c1,list2,c2,{
+		VALUE v;
+		if (optimized_cmp(&opt, c1->value, c2->value, &r)) {
+			v = INT2FIX(r);
+		} else {
+			v = rb_funcall2(c1->value, id_cmp, 1, &(c2->value));
+		}
+		if (v != INT2FIX(0)) {
+			return v;
+		}
+	});
+	return Qundef;
+}
+
+static VALUE
+list_cmp(VALUE list1, VALUE list2)
+{
+	VALUE v;
+	long len;
+
+	if (rb_type(list2) != T_DATA) return Qnil;
+	if (list1 == list2) return INT2FIX(0);
+	v = rb_exec_recursive_paired(recursive_cmp, list1, list2, list2);
+	if (v != Qundef) return v;
+	len = LIST_LEN(list1) - LIST_LEN(list2);
+	if (len == 0) return INT2FIX(0);
+	if (0 < len) return INT2FIX(1);
+	return INT2FIX(-1);
+}
+
+static VALUE
+list_slice_bang(int argc, VALUE *argv, VALUE self)
+{
+	long pos = 0, len = 0;
+
+	list_modify_check(self);
+	if (argc == 1) {
+		if (FIXNUM_P(argv[0])) {
+			return list_delete_at(self, NUM2LONG(argv[0]));
+		} else {
+			switch (rb_range_beg_len(argv[0], &pos, &len, LIST_LEN(self), 0)) {
+			case Qtrue: /* valid range */
+				break;
+			case Qnil: /* invalid range */
+				return Qnil;
+			default: /* not a range */
+				return list_delete_at(self, NUM2LONG(argv[0]));
+			}
+		}
+	} else if (argc == 2) {
+		pos = NUM2LONG(argv[0]);
+		len = NUM2LONG(argv[1]);
+	} else {
+		rb_scan_args(argc, argv, "11", NULL, NULL);
+	}
+	if (len < 0) return Qnil;
+	if (pos < 0) {
+		pos += LIST_LEN(self);
+		if (pos < 0) return Qnil;
+	} else if (LIST_LEN(self) < pos) {
+		return Qnil;
+	}
+	if (LIST_LEN(self) < pos + len) {
+		len = LIST_LEN(self) - pos;
+	}
+	return list_detach(self, pos, len);
+}
+
+static VALUE
+list_assoc(VALUE self, VALUE key)
+{
+	VALUE v;
+	item_t *c;
+
+	if (list_empty_p(self)) return Qnil;
+	LIST_FOR(self, c) {
+		v = check_list_type(c->value);
+		if (!NIL_P(v)) {
+			if (0 < LIST_LEN(v) && rb_equal(list_first(0,NULL,v), key)) {
+				return v;
+			}
+		}
+	}
+	return Qnil;
+}
+
+static VALUE
+list_rassoc(VALUE self, VALUE value)
+{
+	VALUE v;
+	item_t *c;
+
+	if (list_empty_p(self)) return Qnil;
+	LIST_FOR(self, c) {
+		v = check_list_type(c->value);
+		if (!NIL_P(v)) {
+			if (1 < LIST_LEN(v) && rb_equal(list_elt(v,1), value)) {
+				return v;
+			}
+		}
+	}
+	return Qnil;
+}
+
+static VALUE
+list_plus(VALUE x, VALUE y)
+{
+	item_t *c, *cx, *first, *last;
+	long len;
+	VALUE result;
+
+	Check_Type(y, T_DATA);
+	len = LIST_LEN(x) + LIST_LEN(y);
+
+	result = list_new();
+	if (len == 0) return result;
+	first = item_alloc_chain(len, &last);
+	c = first;
+	LIST_FOR(x, cx) {
+		c->value = cx->value;
+		c = c->next;
+	}
+	LIST_FOR(y, cx) {
+		c->value = cx->value;
+		c = c->next;
+	}
+	list_attach(LIST_RAW_PTR(result), first, last, len);
+	return result;
+}
+
+static VALUE
+list_times(VALUE self, VALUE times)
+{
+	VALUE result;
+	VALUE tmp;
+	long len;
+	item_t *c, *n, *first, *last;
+
+	tmp = rb_check_string_type(times);
+	if (!NIL_P(tmp)) {
+		return list_join(self, tmp);
+	}
+
+	len = NUM2LONG(times);
+	if (len == 0) {
+		return rb_obj_alloc(rb_obj_class(self));
+	}
+	if (len < 0) {
+		rb_raise(rb_eArgError, "negative argument");
+	}
+
+	if (LONG_MAX / (long)sizeof(item_t) / len < LIST_LEN(self)) {
+		rb_raise(rb_eArgError, "argument too big");
+	}
+
+	result = rb_obj_alloc(rb_obj_class(self));
+	if (0 < LIST_LEN(self)) {
+		first = item_alloc_chain(len * LIST_LEN(self), &last);
+		c = LIST_PTR(self)->first;
+		for (n = first; n; n = n->next) {
+			n->value = c->value;
+			c = c->next ? c->next : LIST_PTR(self)->first;
+		}
+		list_attach(LIST_RAW_PTR(result), first, last, len * LIST_LEN(self));
+	}
+	return result;
+}
+
+/* open addressing set of VALUEs for uniq and the set operations.
+ * Fixnums, static Symbols, Floats and plain Strings are hashed and compared
+ * without calling #hash and #eql?, which gives the same answers as Hash. */
+
+#define VSET_EMPTY 0
+#define VSET_DELETED 1
+#define VSET_CACHE_CAPA (1 << 16)
+
+struct vset {
+	st_index_t *hashes;
+	VALUE *keys;
+	long capa;
+	long alloc;
+	long used;
+	int in_use;
+};
+
+static struct vset vset_cache;
+
+static void
+vset_mark(struct vset *s)
+{
+	long i;
+
+	if (!s->in_use) return;
+	for (i = 0; i < s->capa; i++) {
+		if (VSET_DELETED < s->hashes[i]) rb_gc_mark(s->keys[i]);
+	}
+}
+
+static void
+vset_free_buffers(struct vset *s)
+{
+	xfree(s->hashes);
+	xfree(s->keys);
+	s->hashes = NULL;
+	s->keys = NULL;
+	s->capa = s->alloc = 0;
+}
+
+static void
+vset_free(struct vset *s)
+{
+	vset_free_buffers(s);
+	xfree(s);
+}
+
+static inline int
+vset_plain_string_p(VALUE v)
+{
+	return RB_TYPE_P(v, T_STRING) && RBASIC_CLASS(v) == rb_cString;
+}
+
+static st_index_t
+vset_hash(VALUE v)
+{
+	st_index_t h;
+	double d;
+
+	if (RB_FLOAT_TYPE_P(v)) {
+		d = RFLOAT_VALUE(v);
+		if (d == 0.0) d = 0.0;
+		h = rb_memhash(&d, sizeof(d));
+	} else if (SPECIAL_CONST_P(v)) {
+		h = rb_hash_end(rb_hash_uint(rb_hash_start(0), (st_index_t)v));
+	} else if (vset_plain_string_p(v)) {
+		h = rb_str_hash(v);
+	} else {
+		h = (st_index_t)NUM2LONG(rb_hash(v));
+	}
+	return h <= VSET_DELETED ? h + 2 : h;
+}
+
+static inline int
+vset_eql(VALUE a, VALUE b)
+{
+	if (a == b) return 1;
+	if (RB_FLOAT_TYPE_P(a)) {
+		return RB_FLOAT_TYPE_P(b) && RFLOAT_VALUE(a) == RFLOAT_VALUE(b);
+	}
+	if (SPECIAL_CONST_P(a) || SPECIAL_CONST_P(b)) return 0;
+	if (vset_plain_string_p(a) && vset_plain_string_p(b)) {
+		return !rb_str_hash_cmp(a, b);
+	}
+	return rb_eql(a, b);
+}
+
+/* make room for n keys, keeping the load factor under 1/2 */
+static void
+vset_setup(struct vset *s, long n)
+{
+	long capa = 16;
+
+	while (capa < n * 2) capa <<= 1;
+	if (s->alloc < capa) {
+		vset_free_buffers(s);
+		s->hashes = ALLOC_N(st_index_t, capa);
+		s->keys = ALLOC_N(VALUE, capa);
+		s->alloc = capa;
+	}
+	MEMZERO(s->hashes, st_index_t, capa);
+	s->capa = capa;
+	s->used = 0;
+}
+
+static void
+vset_grow(struct vset *s)
+{
+	long capa = s->capa * 2, mask = capa - 1, used = 0, i, j;
+	st_index_t *hashes = ZALLOC_N(st_index_t, capa);
+	VALUE *keys = ALLOC_N(VALUE, capa);
+
+	/* the old tables stay marked until the keys are moved */
+	for (i = 0; i < s->capa; i++) {
+		if (s->hashes[i] <= VSET_DELETED) continue;
+		for (j = s->hashes[i] & mask; hashes[j]; j = (j + 1) & mask);
+		hashes[j] = s->hashes[i];
+		keys[j] = s->keys[i];
+		used++;
+	}
+	xfree(s->hashes);
+	xfree(s->keys);
+	s->hashes = hashes;
+	s->keys = keys;
+	s->capa = s->alloc = capa;
+	s->used = used;
+}
+
+/* the slot holding v, or the empty slot ending its probe sequence */
+static long
+vset_find(struct vset *s, VALUE v, st_index_t h)
+{
+	long mask = s->capa - 1, i;
+
+	for (i = h & mask; s->hashes[i]; i = (i + 1) & mask) {
+		if (s->hashes[i] == h && vset_eql(s->keys[i], v)) break;
+	}
+	return i;
+}
+
+/* true if v was not there yet */
+static int
+vset_add(struct vset *s, VALUE v)
+{
+	st_index_t h = vset_hash(v);
+	long i = vset_find(s, v, h);
+
+	if (s->hashes[i]) return 0;
+	s->hashes[i] = h;
+	s->keys[i] = v;
+	if (s->capa < ++s->used * 2) vset_grow(s);
+	return 1;
+}
+
+static int
+vset_include(struct vset *s, VALUE v)
+{
+	return s->hashes[vset_find(s, v, vset_hash(v))] != VSET_EMPTY;
+}
+
+static int
+vset_delete(struct vset *s, VALUE v)
+{
+	long i = vset_find(s, v, vset_hash(v));
+
+	if (!s->hashes[i]) return 0;
+	s->hashes[i] = VSET_DELETED;
+	return 1;
+}
+
+struct vset_arg {
+	struct vset *set;
+	VALUE list1;
+	VALUE list2;
+	VALUE result;
+};
+
+static VALUE
+vset_release(VALUE arg)
+{
+	struct vset *s = (struct vset *)arg;
+
+	s->in_use = 0;
+	if (VSET_CACHE_CAPA < s->alloc) vset_free_buffers(s);
+	return Qnil;
+}
+
+/* run func with the cached set, or a fresh one when called reentrantly */
+static VALUE
+list_with_vset(VALUE (*func)(VALUE), VALUE list1, VALUE list2, long n)
+{
+	struct vset_arg arg;
+	volatile VALUE holder = Qnil;
+
+	if (vset_cache.in_use) {
+		arg.set = ALLOC(struct vset);
+		MEMZERO(arg.set, struct vset, 1);
+		holder = Data_Wrap_Struct(0, vset_mark, vset_free, arg.set);
+	} else {
+		arg.set = &vset_cache;
+	}
+	vset_setup(arg.set, n);
+	arg.set->in_use = 1;
+	arg.list1 = list1;
+	arg.list2 = list2;
+	arg.result = Qnil;
+	rb_ensure(func, (VALUE)&arg, vset_release, (VALUE)arg.set);
+	RB_GC_GUARD(holder);
+	return arg.result;
+}
+
+static VALUE
+diff_i(VALUE a)
+{
+	struct vset_arg *arg = (struct vset_arg *)a;
+	item_t *c;
+
+	LIST_FOR(arg->list2, c) {
+		vset_add(arg->set, c->value);
+	}
+	arg->result = list_new();
+	LIST_FOR(arg->list1, c) {
+		if (vset_include(arg->set, c->value)) continue;
+		list_push_item(arg->result, c->value);
+	}
+	return Qnil;
+}
+
+static VALUE
+list_diff(VALUE list1, VALUE list2)
+{
+	list2 = to_list(list2);
+	return list_with_vset(diff_i, list1, list2, LIST_LEN(list2));
+}
+
+static VALUE
+and_i(VALUE a)
+{
+	struct vset_arg *arg = (struct vset_arg *)a;
+	item_t *c;
+
+	LIST_FOR(arg->list2, c) {
+		vset_add(arg->set, c->value);
+	}
+	arg->result = list_new();
+	LIST_FOR(arg->list1, c) {
+		if (vset_delete(arg->set, c->value)) {
+			list_push_item(arg->result, c->value);
+		}
+	}
+	return Qnil;
+}
+
+static VALUE
+list_and(VALUE list1, VALUE list2)
+{
+	list2 = to_list(list2);
+	if (LIST_LEN(list2) == 0) return list_new();
+	return list_with_vset(and_i, list1, list2, LIST_LEN(list2));
+}
+
+static VALUE
+or_i(VALUE a)
+{
+	struct vset_arg *arg = (struct vset_arg *)a;
+	item_t *c;
+
+	arg->result = list_new();
+	LIST_FOR(arg->list1, c) {
+		if (vset_add(arg->set, c->value)) {
+			list_push_item(arg->result, c->value);
+		}
+	}
+	LIST_FOR(arg->list2, c) {
+		if (vset_add(arg->set, c->value)) {
+			list_push_item(arg->result, c->value);
+		}
+	}
+	return Qnil;
+}
+
+static VALUE
+list_or(VALUE list1, VALUE list2)
+{
+	list2 = to_list(list2);
+	return list_with_vset(or_i, list1, list2, LIST_LEN(list1) + LIST_LEN(list2));
+}
+
+/* set operations walking two sorted chains in lockstep */
+enum sorted_setop {
+	SORTED_UNION,
+	SORTED_INTERSECTION,
+	SORTED_DIFFERENCE
+};
+
+struct sorted_emit {
+	VALUE list;
+	VALUE last;
+	struct cmp_opt *opt;
+};
+
+static int
+sorted_cmp(struct cmp_opt *opt, VALUE a, VALUE b)
+{
+	int r;
+
+	if (!optimized_cmp(opt, a, b, &r)) {
+		r = rb_cmpint(rb_funcall(a, id_cmp, 1, b), a, b);
+	}
+	return r;
+}
+
+/* append v unless it equals the last one appended */
+static void
+sorted_emit(struct sorted_emit *out, VALUE v)
+{
+	if (out->last != Qundef && sorted_cmp(out->opt, out->last, v) == 0) return;
+	list_push_item(out->list, v);
+	out->last = v;
+}
+
+static VALUE
+list_sorted_setop(VALUE list1, VALUE list2, enum sorted_setop op)
+{
+	struct cmp_opt opt = CMP_OPT_INIT;
+	struct sorted_emit out;
+	item_t *a, *b;
+	int r;
+
+	list2 = to_list(list2);
+	out.list = list_new();
+	out.last = Qundef;
+	out.opt = &opt;
+	a = LIST_PTR(list1)->first;
+	b = LIST_PTR(list2)->first;
+	while (a && b) {
+		r = sorted_cmp(&opt, a->value, b->value);
+		if (r < 0) {
+			if (op != SORTED_INTERSECTION) sorted_emit(&out, a->value);
+			a = a->next;
+		} else if (0 < r) {
+			if (op == SORTED_UNION) sorted_emit(&out, b->value);
+			b = b->next;
+		} else {
+			if (op != SORTED_DIFFERENCE) {
+				sorted_emit(&out, a->value);
+				b = b->next;
+			}
+			a = a->next;
+		}
+	}
+	if (op != SORTED_INTERSECTION) {
+		for (; a; a = a->next) sorted_emit(&out, a->value);
+	}
+	if (op == SORTED_UNION) {
+		for (; b; b = b->next) sorted_emit(&out, b->value);
+	}
+	RB_GC_GUARD(list2);
+	return out.list;
+}
+
+static VALUE
+list_sorted_union(VALUE list1, VALUE list2)
+{
+	return list_sorted_setop(list1, list2, SORTED_UNION);
+}
+
+static VALUE
+list_sorted_intersection(VALUE list1, VALUE list2)
+{
+	return list_sorted_setop(list1, list2, SORTED_INTERSECTION);
+}
+
+static VALUE
+list_sorted_difference(VALUE list1, VALUE list2)
+{
+	return list_sorted_setop(list1, list2, SORTED_DIFFERENCE);
+}
+
+static VALUE
+list_dup(VALUE self)
+{
+	return list_replace(list_new(), self);
+}
+
+static VALUE
+uniq_i(VALUE a)
+{
+	struct vset_arg *arg = (struct vset_arg *)a;
+	int block_given = rb_block_given_p();
+	item_t *c;
+
+	arg->result = list_new();
+	LIST_FOR(arg->list1, c) {
+		if (vset_add(arg->set, block_given ? rb_yield(c->value) : c->value)) {
+			list_push_item(arg->result, c->value);
+		}
+	}
+	return Qnil;
+}
+
+static VALUE
+list_uniq(VALUE self)
+{
+	if (LIST_LEN(self) <= 1)
+		return list_dup(self);
+	return list_with_vset(uniq_i, self, Qnil, LIST_LEN(self));
+}
+
+static int
+uniq_keep(VALUE v, void *data)
+{
+	struct vset_arg *arg = (struct vset_arg *)data;
+
+	if (rb_block_given_p()) {
+		v = rb_yield(v);
 	}
+	return vset_add(arg->set, v);
 }
 
 static VALUE
-list_delete_at_m(VALUE self, VALUE pos)
+uniq_bang_i(VALUE a)
 {
-	return list_delete_at(self, NUM2LONG(pos));
+	struct vset_arg *arg = (struct vset_arg *)a;
+
+	list_filter_bang(arg->list1, uniq_keep, arg);
+	return Qnil;
 }
 
 static VALUE
-reject(VALUE self, VALUE result)
+list_uniq_bang(VALUE self)
 {
-	item_t *c;
+	long len;
 
-	LIST_FOR(self, c) {
-		if (!RTEST(rb_yield(c->value))) {
-			list_push(result, c->value);
-		}
+	list_modify_check(self);
+	len = LIST_LEN(self);
+	if (len <= 1)
+		return Qnil;
+
+	list_with_vset(uniq_bang_i, self, Qnil, len);
+	if (len == LIST_LEN(self)) {
+		return Qnil;
 	}
-	return result;
+
+	return self;
 }
 
 static VALUE
-reject_bang(VALUE self)
+list_compact_bang(VALUE self)
 {
 	list_t *ptr;
 	item_t *c, *before = NULL, *next;
 	long len;
 
-	Data_Get_Struct(self, list_t, ptr);
-	len = LIST_LEN(self);
+	list_modify_check(self);
+	ptr = LIST_PTR(self);
+	len = LIST_PTR_LEN(ptr);
 	for (c = ptr->first; c; c = next) {
 		next = c->next;
-		if (RTEST(rb_yield(c->value))) {
-			if (ptr->first == ptr->last) {
-				ptr->first = NULL;
-				ptr->last = NULL;
-			} else if (c == ptr->first) {
-				ptr->first = c->next;
-			} else if (c == ptr->last) {
-				ptr->last = before;
-				ptr->last->next = NULL;
-			} else {
-				before->next = c->next;
-			}
-			xfree(c);
-			LIST_LEN(self)--;
+		if (NIL_P(c->value)) {
+			list_unlink(ptr, before, c);
 		} else {
 			before = c;
 		}
 	}
-
-	if (LIST_LEN(self) == len) {
+	if (len == LIST_PTR_LEN(ptr)) {
 		return Qnil;
-	} else {
-		return self;
 	}
+	return self;
 }
 
 static VALUE
-list_reject_bang(VALUE self)
+list_compact(VALUE self)
 {
-	RETURN_SIZED_ENUMERATOR(self, 0, 0, list_enum_length);
-	return reject_bang(self);
+	self = list_dup(self);
+	list_compact_bang(self);
+	return self;
 }
 
 static VALUE
-list_reject(VALUE self)
+list_make_shared_copy(VALUE list)
 {
-	VALUE rejected_list;
-
-	RETURN_SIZED_ENUMERATOR(self, 0, 0, list_enum_length);
-	rejected_list = list_new();
-	reject(self, rejected_list);
-	return rejected_list;
+	return list_make_partial(list, rb_obj_class(list), 0, LIST_LEN(list));
 }
 
+struct flatten_frame {
+	VALUE src;
+	item_t *c;	/* next item when src is a List */
+	long i;		/* next index when src is an Array */
+};
+
+struct flatten_arg {
+	VALUE list;
+	list_t *ptr;
+	VALUE orig;
+	VALUE owner;	/* receiver of flatten!, whose chain is being worked on */
+	VALUE guard;	/* keeps the frames' sources alive */
+	int level;
+	int modified;
+	struct flatten_frame *stack;
+	long depth;
+	long capa;
+	item_t *mark;	/* last item before the container being expanded */
+	item_t *cur;	/* the container being expanded */
+};
+
 static VALUE
-list_delete_if(VALUE self)
+flatten_target(VALUE obj)
 {
-	RETURN_SIZED_ENUMERATOR(self, 0, 0, list_enum_length);
-	list_reject_bang(self);
-	return self;
+	if (TYPE(obj) == T_ARRAY) return obj;
+	return check_list_type(obj);
 }
 
-static VALUE
-list_zip(int argc, VALUE *argv, VALUE self)
+static void
+flatten_push_frame(struct flatten_arg *arg, VALUE src)
 {
-	VALUE ary;
+	struct flatten_frame *f;
 	long i;
 
-	ary = rb_funcall2(list_to_a(self), rb_intern("zip"), argc, argv);
-	if (rb_block_given_p()) {
-		for (i = 0; i < RARRAY_LEN(ary); i++) {
-			rb_yield(rb_ary_entry(ary, i));
+	if (src == arg->orig && (arg->level < 0 || arg->owner)) goto recursive;
+	if (arg->level < 0) {
+		for (i = 0; i < arg->depth; i++) {
+			if (arg->stack[i].src == src) goto recursive;
 		}
-		return Qnil;
-	} else {
-		return to_list(ary);
 	}
+	if (arg->depth == arg->capa) {
+		arg->capa = arg->capa ? arg->capa * 2 : 16;
+		REALLOC_N(arg->stack, struct flatten_frame, arg->capa);
+	}
+	f = &arg->stack[arg->depth++];
+	f->src = src;
+	f->i = 0;
+	f->c = TYPE(src) == T_ARRAY ? NULL : LIST_PTR(src)->first;
+	rb_ary_push(arg->guard, src);
+	return;
+
+recursive:
+	rb_raise(rb_eArgError, "tried to flatten recursive list");
 }
 
-static VALUE
-list_transpose(VALUE self)
-{
-	return list_delegate_rb(0, NULL, self, rb_intern("transpose"));
+/* insert the leaves of arg->cur in front of it, returning the last one */
+static item_t *
+flatten_expand(struct flatten_arg *arg, VALUE src)
+{
+	list_t *ptr = arg->ptr;
+	struct flatten_frame *f;
+	item_t *prev = arg->mark, *n;
+	VALUE v, t;
+
+	flatten_push_frame(arg, src);
+	while (arg->depth) {
+		f = &arg->stack[arg->depth - 1];
+		if (TYPE(f->src) == T_ARRAY) {
+			if (RARRAY_LEN(f->src) <= f->i) goto pop;
+			v = RARRAY_AREF(f->src, f->i);
+			f->i++;
+		} else {
+			if (f->c == NULL) goto pop;
+			v = f->c->value;
+			f->c = f->c->next;
+		}
+		t = Qnil;
+		if (arg->level < 0 || arg->depth < arg->level) {
+			t = flatten_target(v);
+		}
+		if (!NIL_P(t)) {
+			flatten_push_frame(arg, t);
+			continue;
+		}
+		n = item_alloc(v, arg->cur);
+		if (prev) {
+			prev->next = n;
+		} else {
+			ptr->first = n;
+		}
+		prev = n;
+		LIST_PTR_LEN(ptr)++;
+		continue;
+pop:
+		arg->depth--;
+		rb_ary_pop(arg->guard);
+	}
+	return prev;
 }
 
 static VALUE
-list_fill(int argc, VALUE *argv, VALUE self)
+flatten_i(VALUE data)
 {
-	VALUE item, arg1, arg2;
-	long beg = 0, len = 0, end = 0;
-	long i;
-	int block_p = FALSE;
-	item_t *c;
+	struct flatten_arg *arg = (struct flatten_arg *)data;
+	list_t *ptr = arg->ptr;
+	item_t *prev = NULL, *c, *next;
+	VALUE t;
 
-	list_modify_check(self);
-	if (rb_block_given_p()) {
-		block_p = TRUE;
-		rb_scan_args(argc, argv, "02", &arg1, &arg2);
-		argc += 1; /* hackish */
-	} else {
-		rb_scan_args(argc, argv, "12", &item, &arg1, &arg2);
-	}
-	switch (argc) {
-	case 1:
-		beg = 0;
-		len = LIST_LEN(self);
-		break;
-	case 2:
-		if (rb_range_beg_len(arg1, &beg, &len, LIST_LEN(self), 1)) {
-			break;
-		}
-		/* fall through */
-	case 3:
-		beg = NIL_P(arg1) ? 0 : NUM2LONG(arg1);
-		if (beg < 0) {
-			beg = LIST_LEN(self) + beg;
-			if (beg < 0) beg = 0;
-		}
-		len = NIL_P(arg2) ? LIST_LEN(self) - beg : NUM2LONG(arg2);
-		break;
-	}
-	if (len < 0) {
-		return self;
-	}
-	if (LIST_MAX_SIZE <= beg || LIST_MAX_SIZE - beg < len) {
-		rb_raise(rb_eArgError, "argument too big");
-	}
-	end = beg + len;
-	if (LIST_LEN(self) < end) {
-		for (i = 0; i < end - LIST_LEN(self); i++) {
-			list_push(self, Qnil);
+	c = ptr->first;
+	while (c) {
+		t = flatten_target(c->value);
+		if (NIL_P(t)) {
+			prev = c;
+			c = c->next;
+			continue;
 		}
-	}
+		arg->modified = 1;
+		arg->mark = prev;
+		arg->cur = c;
+		prev = flatten_expand(arg, t);
+		arg->cur = NULL;
 
-	i = -1;
-	LIST_FOR(self, c) {
-		i++;
-		if (i < beg) continue;
-		if ((end - 1) < i) break;
-		if (block_p) {
-			c->value = rb_yield(LONG2NUM(i));
+		/* drop the container */
+		next = c->next;
+		if (prev) {
+			prev->next = next;
 		} else {
-			c->value = item;
+			ptr->first = next;
 		}
+		if (ptr->last == c) ptr->last = prev;
+		item_free(c);
+		LIST_PTR_LEN(ptr)--;
+		c = next;
 	}
-	return self;
+	return Qnil;
 }
 
 static VALUE
-list_include_p(VALUE self, VALUE item)
+flatten_ensure(VALUE data)
 {
-	item_t *c;
+	struct flatten_arg *arg = (struct flatten_arg *)data;
+	list_t *ptr = arg->ptr;
+	item_t *c, *next;
 
-	LIST_FOR(self, c) {
-		if (rb_equal(c->value, item)) {
-			return Qtrue;
+	xfree(arg->stack);
+	if (arg->cur) {
+		/* interrupted: take back the leaves inserted before the container */
+		c = arg->mark ? arg->mark->next : ptr->first;
+		while (c != arg->cur) {
+			next = c->next;
+			item_free(c);
+			LIST_PTR_LEN(ptr)--;
+			c = next;
+		}
+		if (arg->mark) {
+			arg->mark->next = arg->cur;
+		} else {
+			ptr->first = arg->cur;
 		}
 	}
-	return Qfalse;
+	if (arg->owner) {
+		list_steal(arg->owner, arg->list);
+	}
+	return Qnil;
+}
+
+/*
+ * flatten the chain of list in place, orig being the list seen by the caller.
+ * with owner, the chain is given back to it afterwards.
+ */
+static int
+flatten(VALUE list, VALUE orig, VALUE owner, int level)
+{
+	struct flatten_arg arg;
+	volatile VALUE guard = rb_ary_new();
+
+	arg.list = list;
+	arg.ptr = LIST_RAW_PTR(list);
+	arg.orig = orig;
+	arg.owner = owner;
+	arg.guard = guard;
+	arg.level = level;
+	arg.modified = 0;
+	arg.stack = NULL;
+	arg.depth = 0;
+	arg.capa = 0;
+	arg.mark = NULL;
+	arg.cur = NULL;
+	rb_ensure(flatten_i, (VALUE)&arg, flatten_ensure, (VALUE)&arg);
+	RB_GC_GUARD(guard);
+	return arg.modified;
 }
 
 static VALUE
-recursive_cmp(VALUE list1, VALUE list2, int recur)
+list_flatten(int argc, VALUE *argv, VALUE self)
 {
-	item_t *c1, *c2;
+	int level = -1;
 	long len;
+	VALUE result, lv;
+	item_t *first, *last;
 
-	if (recur) return Qundef;
-	len = LIST_LEN(list1);
-	if (LIST_LEN(list2) < len) {
-		len = LIST_LEN(list2);
+	rb_scan_args(argc, argv, "01", &lv);
+	if (!NIL_P(lv)) level = NUM2INT(lv);
+	if (level == 0) return list_make_shared_copy(self);
+
+	result = list_new();
+	len = LIST_LEN(self);
+	if (0 < len) {
+		first = item_chain_copy(self, len, &last);
+		list_attach(LIST_RAW_PTR(result), first, last, len);
 	}
-	LIST_FOR_DOUBLE(list1,c1,list2,c2,{
-		VALUE v = rb_funcall2(c1->value, id_cmp, 1, &(c2->value));
-		if (v != INT2FIX(0)) {
-			return v;
-		}
-	});
-	return Qundef;
+	flatten(result, self, 0, level);
+	OBJ_INFECT(result, self);
+
+	return result;
 }
 
 static VALUE
-list_cmp(VALUE list1, VALUE list2)
+list_flatten_bang(int argc, VALUE *argv, VALUE self)
 {
-	VALUE v;
-	long len;
+	int mod, level = -1;
+	VALUE tmp, lv;
 
-	if (rb_type(list2) != T_DATA) return Qnil;
-	if (list1 == list2) return INT2FIX(0);
-	v = rb_exec_recursive_paired(recursive_cmp, list1, list2, list2);
-	if (v != Qundef) return v;
-	len = LIST_LEN(list1) - LIST_LEN(list2);
-	if (len == 0) return INT2FIX(0);
-	if (0 < len) return INT2FIX(1);
-	return INT2FIX(-1);
+	rb_scan_args(argc, argv, "01", &lv);
+	list_modify_check(self);
+	if (!NIL_P(lv)) level = NUM2INT(lv);
+	if (level == 0) return Qnil;
+
+	/* work on a hidden list so that callbacks can not see half-done state */
+	tmp = list_new();
+	list_steal(tmp, self);
+	mod = flatten(tmp, self, self, level);
+	if (mod == 0) {
+		return Qnil;
+	}
+	return self;
 }
 
 static VALUE
-list_slice_bang(int argc, VALUE *argv, VALUE self)
+list_count(int argc, VALUE *argv, VALUE self)
 {
-	long pos = 0, len = 0;
+	struct cmp_opt opt = CMP_OPT_INIT;
+	VALUE obj;
+	item_t *c;
+	long n = 0;
 
-	list_modify_check(self);
-	if (argc == 1) {
-		if (FIXNUM_P(argv[0])) {
-			return list_delete_at(self, NUM2LONG(argv[0]));
-		} else {
-			switch (rb_range_beg_len(argv[0], &pos, &len, LIST_LEN(self), 0)) {
-			case Qtrue: /* valid range */
-				break;
-			case Qnil: /* invalid range */
-				return Qnil;
-			default: /* not a range */
-				return list_delete_at(self, NUM2LONG(argv[0]));
-			}
+	if (argc == 0) {
+		if (!rb_block_given_p()) {
+			return list_length(self);
+		}
+		LIST_FOR(self,c) {
+			if (RTEST(rb_yield(c->value))) n++;
 		}
-	} else if (argc == 2) {
-		pos = NUM2LONG(argv[0]);
-		len = NUM2LONG(argv[1]);
 	} else {
-		rb_scan_args(argc, argv, "11", NULL, NULL);
-	}
-	if (len < 0) return Qnil;
-	if (pos < 0) {
-		pos += LIST_LEN(self);
-		if (pos < 0) return Qnil;
-	} else if (LIST_LEN(self) < pos) {
-		return Qnil;
-	}
-	if (LIST_LEN(self) < pos + len) {
-		len = LIST_LEN(self) - pos;
+		rb_scan_args(argc, argv, "1", &obj);
+		if (rb_block_given_p()) {
+			rb_warn("given block not used");
+		}
+		LIST_FOR(self,c) {
+			if (optimized_equal(&opt, c->value, obj)) n++;
+		}
 	}
-	if (len == 0) return list_new();
-	VALUE list2 = list_subseq(self, pos, len);
-	list_mem_clear(self, pos, len);
-	return list2;
+	return LONG2NUM(n);
 }
 
-static VALUE
-list_assoc(VALUE self, VALUE key)
+static inline int
+list_min_max_cmp(struct cmp_opt *opt, VALUE a, VALUE b)
 {
-	VALUE v;
-	item_t *c;
+	int r;
 
-	if (list_empty_p(self)) return Qnil;
-	LIST_FOR(self, c) {
-		v = check_list_type(c->value);
-		if (!NIL_P(v)) {
-			if (0 < LIST_LEN(v) && rb_equal(list_first(0,NULL,v), key)) {
-				return v;
-			}
-		}
+	if (rb_block_given_p()) {
+		r = rb_cmpint(rb_yield_values(2, a, b), a, b);
+	} else if (!optimized_cmp(opt, a, b, &r)) {
+		r = rb_cmpint(rb_funcall(a, id_cmp, 1, b), a, b);
 	}
-	return Qnil;
+	return r;
 }
 
 static VALUE
-list_rassoc(VALUE self, VALUE value)
+list_min_max(int argc, VALUE *argv, VALUE self, int sign)
 {
-	VALUE v;
+	struct cmp_opt opt = CMP_OPT_INIT;
 	item_t *c;
+	VALUE v, result = Qundef;
 
-	if (list_empty_p(self)) return Qnil;
 	LIST_FOR(self, c) {
-		v = check_list_type(c->value);
-		if (!NIL_P(v)) {
-			if (1 < LIST_LEN(v) && rb_equal(list_elt(v,1), value)) {
-				return v;
-			}
+		v = c->value;
+		if (result == Qundef) {
+			result = v;
+			continue;
+		}
+		if (list_min_max_cmp(&opt, v, result) * sign < 0) {
+			result = v;
 		}
 	}
-	return Qnil;
+	return result == Qundef ? Qnil : result;
 }
 
-static VALUE
-list_plus(VALUE x, VALUE y)
-{
-	item_t *cx, *cy;
+/*
+ * Top-k selection for min(n), max(n), min_by and max_by: a bounded binary
+ * heap whose root is the worst of the kept entries, so memory stays O(k).
+ */
+
+struct topk_entry {
+	VALUE key;
+	VALUE value;
+	long idx;
+};
+
+struct topk {
+	struct topk_entry *heap;
+	long capa;
 	long len;
-	VALUE result;
+	int sign;	/* 1 keeps the smallest, -1 the largest */
+	int by;		/* keys come from the block */
+	struct cmp_opt opt;
+};
 
-	Check_Type(y, T_DATA);
-	len = LIST_LEN(x) + LIST_LEN(y);
+static void
+topk_mark(struct topk *t)
+{
+	long i;
 
-	result = list_new();
-	LIST_FOR(x,cx) {
-		list_push(result, cx->value);
+	for (i = 0; i < t->len; i++) {
+		rb_gc_mark(t->heap[i].key);
+		rb_gc_mark(t->heap[i].value);
 	}
-	LIST_FOR(y,cy) {
-		list_push(result, cy->value);
-	}
-	return result;
 }
 
-static VALUE
-list_times(VALUE self, VALUE times)
+static void
+topk_free(struct topk *t)
 {
-	VALUE result;
-	VALUE tmp;
-	long i, len;
-	item_t *c;
-
-	tmp = rb_check_string_type(times);
-	if (!NIL_P(tmp)) {
-		return list_join(self, tmp);
-	}
+	xfree(t->heap);
+	xfree(t);
+}
 
-	len = NUM2LONG(times);
-	if (len == 0) {
-		return rb_obj_alloc(rb_obj_class(self));
-	}
-	if (len < 0) {
-		rb_raise(rb_eArgError, "negative argument");
-	}
+/* positive when x comes after y in the result; ties keep the earlier one first */
+static int
+topk_cmp(struct topk *t, struct topk_entry *x, struct topk_entry *y)
+{
+	int r;
 
-	if (LIST_MAX_SIZE / len < LIST_LEN(self)) {
-		rb_raise(rb_eArgError, "argument too big");
+	if (!t->by && rb_block_given_p()) {
+		r = rb_cmpint(rb_yield_values(2, x->key, y->key), x->key, y->key);
+	} else if (!optimized_cmp(&t->opt, x->key, y->key, &r)) {
+		r = rb_cmpint(rb_funcall(x->key, id_cmp, 1, y->key), x->key, y->key);
 	}
-
-	result = rb_obj_alloc(rb_obj_class(self));
-	if (0 < LIST_LEN(self)) {
-		for (i = 0; i < len; i++) {
-			LIST_FOR(self, c) {
-				list_push(result, c->value);
-			}
-		}
+	r *= t->sign;
+	if (r == 0) {
+		r = (x->idx > y->idx) - (x->idx < y->idx);
 	}
-	return result;
+	return r;
 }
 
-static inline VALUE
-list_tmp_hash_new(void)
+static inline void
+topk_swap(struct topk *t, long i, long j)
 {
-	VALUE hash = rb_hash_new();
-	RBASIC_CLEAR_CLASS(hash);
-	return hash;
+	struct topk_entry e = t->heap[i];
+
+	t->heap[i] = t->heap[j];
+	t->heap[j] = e;
 }
 
-static VALUE
-list_add_hash(VALUE hash, VALUE list)
+static void
+topk_sift_down(struct topk *t, long i, long len)
 {
-	item_t *c;
+	long l, m;
 
-	LIST_FOR(list, c) {
-		if (rb_hash_lookup2(hash, c->value, Qundef) == Qundef) {
-			rb_hash_aset(hash, c->value, c->value);
-		}
+	while ((l = 2 * i + 1) < len) {
+		m = i;
+		if (0 < topk_cmp(t, &t->heap[l], &t->heap[m])) m = l;
+		if (l + 1 < len && 0 < topk_cmp(t, &t->heap[l + 1], &t->heap[m])) m = l + 1;
+		if (m == i) break;
+		topk_swap(t, i, m);
+		i = m;
 	}
-	return hash;
 }
 
-static VALUE
-list_make_hash(VALUE list)
-{
-	VALUE hash = list_tmp_hash_new();
-	return list_add_hash(hash, list);
+static void
+topk_add(struct topk *t, VALUE key, VALUE value, long idx)
+{
+	struct topk_entry e;
+	long i, parent;
+
+	e.key = key;
+	e.value = value;
+	e.idx = idx;
+	if (t->len < t->capa) {
+		i = t->len;
+		t->heap[t->len++] = e;
+		while (0 < i) {
+			parent = (i - 1) / 2;
+			if (topk_cmp(t, &t->heap[i], &t->heap[parent]) <= 0) break;
+			topk_swap(t, i, parent);
+			i = parent;
+		}
+	} else if (topk_cmp(t, &e, &t->heap[0]) < 0) {
+		t->heap[0] = e;
+		topk_sift_down(t, 0, t->len);
+	}
 }
 
 static VALUE
-list_add_hash_by(VALUE hash, VALUE list)
+list_topk(VALUE self, long n, int sign, int by)
 {
-	VALUE v, k;
+	struct topk *t;
+	volatile VALUE holder;
+	VALUE ary, key;
 	item_t *c;
+	long i = 0, len;
 
-	LIST_FOR(list, c) {
-		v = c->value;
-		k = rb_yield(v);
-		if (rb_hash_lookup2(hash, k, Qundef) == Qundef) {
-			rb_hash_aset(hash, k, v);
+	if (n < 0) {
+		rb_raise(rb_eArgError, "negative size (%ld)", n);
+	}
+	len = LIST_LEN(self);
+	if (len < n) n = len;
+	t = ALLOC(struct topk);
+	MEMZERO(t, struct topk, 1);
+	holder = Data_Wrap_Struct(0, topk_mark, topk_free, t);
+	t->heap = ALLOC_N(struct topk_entry, n ? n : 1);
+	t->capa = n;
+	t->sign = sign;
+	t->by = by;
+	if (0 < n) {
+		LIST_FOR(self, c) {
+			key = by ? rb_yield(c->value) : c->value;
+			topk_add(t, key, c->value, i++);
 		}
 	}
-	return hash;
+	for (len = t->len; 1 < len; len--) {
+		topk_swap(t, 0, len - 1);
+		topk_sift_down(t, 0, len - 1);
+	}
+	ary = rb_ary_new2(t->len);
+	for (i = 0; i < t->len; i++) {
+		rb_ary_push(ary, t->heap[i].value);
+	}
+	RB_GC_GUARD(holder);
+	return ary;
 }
 
 static VALUE
-list_make_hash_by(VALUE list)
+list_min(int argc, VALUE *argv, VALUE self)
 {
-	VALUE hash = list_tmp_hash_new();
-	return list_add_hash_by(hash, list);
+	if (rb_check_arity(argc, 0, 1) && !NIL_P(argv[0])) {
+		return list_topk(self, NUM2LONG(argv[0]), 1, FALSE);
+	}
+	return list_min_max(0, NULL, self, 1);
 }
 
 static VALUE
-list_diff(VALUE list1, VALUE list2)
+list_max(int argc, VALUE *argv, VALUE self)
 {
-	VALUE list3;
-	volatile VALUE hash;
-	item_t *c;
-
-	hash = list_make_hash(to_list(list2));
-	list3 = list_new();
-
-	LIST_FOR(list1, c) {
-		if (st_lookup(RHASH_TBL(hash), c->value, 0)) continue;
-		list_push(list3, c->value);
+	if (rb_check_arity(argc, 0, 1) && !NIL_P(argv[0])) {
+		return list_topk(self, NUM2LONG(argv[0]), -1, FALSE);
 	}
-	return list3;
+	return list_min_max(0, NULL, self, -1);
 }
 
 static VALUE
-list_and(VALUE list1, VALUE list2)
+list_minmax(VALUE self)
 {
-	VALUE list3, hash;
-	st_table *table;
-	st_data_t vv;
-	item_t *c1;
-
-	list2 = to_list(list2);
-	list3 = list_new();
-	if (LIST_LEN(list2) == 0) return list3;
-	hash = list_make_hash(list2);
-	table = RHASH_TBL(hash);
+	struct cmp_opt opt = CMP_OPT_INIT;
+	item_t *c;
+	VALUE min = Qundef, max = Qundef;
 
-	LIST_FOR(list1, c1) {
-		vv = (st_data_t) c1->value;
-		if (st_delete(table, &vv, 0)) {
-			list_push(list3, c1->value);
+	LIST_FOR(self, c) {
+		if (min == Qundef) {
+			min = max = c->value;
+			continue;
+		}
+		if (list_min_max_cmp(&opt, c->value, min) < 0) {
+			min = c->value;
+		} else if (0 < list_min_max_cmp(&opt, c->value, max)) {
+			max = c->value;
 		}
 	}
-
-	return list3;
+	if (min == Qundef) return rb_assoc_new(Qnil, Qnil);
+	return rb_assoc_new(min, max);
 }
 
-static int
-values_i(VALUE key, VALUE value, VALUE list)
+/* Integer arithmetic for the exact sum, never dispatching to a
+ * redefined Integer#+ or Integer#* */
+static VALUE
+sum_int_plus(VALUE x, VALUE y)
 {
-	list_push(list, value);
-	return ST_CONTINUE;
+	if (FIXNUM_P(x) && FIXNUM_P(y)) return LONG2NUM(FIX2LONG(x) + FIX2LONG(y));
+	return FIXNUM_P(x) ? rb_big_plus(y, x) : rb_big_plus(x, y);
 }
 
 static VALUE
-list_hash_values(VALUE hash)
+sum_int_mul(VALUE x, VALUE y)
 {
-	VALUE list;
-
-	list = list_new();
-	rb_hash_foreach(hash, values_i, list);
-
-	return list;
+	if (FIXNUM_P(x)) x = rb_int2big(FIX2LONG(x));
+	return rb_big_mul(x, y);
 }
 
+/* x + y for Integers and Rationals */
 static VALUE
-list_or(VALUE list1, VALUE list2)
+sum_exact_plus(VALUE x, VALUE y)
 {
-	VALUE hash, list3;
-	st_data_t vv;
-	item_t *c1, *c2;
+	VALUE xn = x, xd = INT2FIX(1), yn = y, yd = INT2FIX(1);
 
-	list2 = to_list(list2);
-	list3 = list_new();
-	hash = list_add_hash(list_make_hash(list1), list2);
-
-	LIST_FOR(list1,c1) {
-		vv = (st_data_t)c1->value;
-		if (st_delete(RHASH_TBL(hash), &vv, 0)) {
-			list_push(list3, c1->value);
-		}
+	if (!RB_TYPE_P(x, T_RATIONAL) && !RB_TYPE_P(y, T_RATIONAL)) {
+		return sum_int_plus(x, y);
 	}
-	LIST_FOR(list2,c2) {
-		vv = (st_data_t)c2->value;
-		if (st_delete(RHASH_TBL(hash), &vv, 0)) {
-			list_push(list3, c2->value);
-		}
+	if (RB_TYPE_P(x, T_RATIONAL)) {
+		xn = rb_rational_num(x);
+		xd = rb_rational_den(x);
 	}
-	return list3;
+	if (RB_TYPE_P(y, T_RATIONAL)) {
+		yn = rb_rational_num(y);
+		yd = rb_rational_den(y);
+	}
+	return rb_rational_new(sum_int_plus(sum_int_mul(xn, yd), sum_int_mul(yn, xd)),
+			       sum_int_mul(xd, yd));
 }
 
 static VALUE
-list_dup(VALUE self)
+sum_exact_finish(long n, VALUE r, VALUE v)
 {
-	return list_replace(list_new(), self);
+	if (n != 0) v = sum_exact_plus(LONG2FIX(n), v);
+	if (r != Qundef) {
+		v = sum_exact_plus(r, v);
+	}
+	return v;
 }
 
+/* follows Array#sum: Integers and Rationals are summed exactly, then
+ * Floats with Kahan-Babuska compensation, and anything else with + */
 static VALUE
-list_uniq(VALUE self)
+list_sum(int argc, VALUE *argv, VALUE self)
 {
-	VALUE hash, uniq;
+	VALUE v, e = Qundef, r = Qundef;
+	item_t *c = LIST_PTR(self)->first;
+	long n = 0;
+	double f, comp, x, t;
+	int block_given = rb_block_given_p();
+
+	v = rb_check_arity(argc, 0, 1) ? argv[0] : LONG2FIX(0);
+	if (!FIXNUM_P(v) && !RB_TYPE_P(v, T_BIGNUM) && !RB_TYPE_P(v, T_RATIONAL)) {
+		goto init_is_a_value;
+	}
+	for (; c; c = c->next) {
+		e = block_given ? rb_yield(c->value) : c->value;
+		if (FIXNUM_P(e)) {
+			n += FIX2LONG(e);
+			if (!FIXABLE(n)) {
+				v = rb_big_plus(LONG2NUM(n), v);
+				n = 0;
+			}
+		} else if (RB_TYPE_P(e, T_BIGNUM)) {
+			v = rb_big_plus(e, v);
+		} else if (RB_TYPE_P(e, T_RATIONAL)) {
+			r = r == Qundef ? e : sum_exact_plus(r, e);
+		} else {
+			goto not_exact;
+		}
+	}
+	return sum_exact_finish(n, r, v);
+
+  not_exact:
+	v = sum_exact_finish(n, r, v);
+	if (RB_FLOAT_TYPE_P(e)) {
+		f = NUM2DBL(v);
+		comp = 0.0;
+		goto has_float_value;
+		for (; c; c = c->next) {
+			e = block_given ? rb_yield(c->value) : c->value;
+			if (RB_FLOAT_TYPE_P(e))
+			  has_float_value:
+				x = RFLOAT_VALUE(e);
+			else if (FIXNUM_P(e))
+				x = FIX2LONG(e);
+			else if (RB_TYPE_P(e, T_BIGNUM))
+				x = rb_big2dbl(e);
+			else if (RB_TYPE_P(e, T_RATIONAL))
+				x = rb_num2dbl(e);
+			else
+				goto not_float;
+
+			if (isnan(f)) continue;
+			if (isnan(x)) {
+				f = x;
+				continue;
+			}
+			if (isinf(x)) {
+				f = isinf(f) && signbit(x) != signbit(f) ? NAN : x;
+				continue;
+			}
+			if (isinf(f)) continue;
 
-	if (LIST_LEN(self) <= 1)
-		return list_dup(self);
+			t = f + x;
+			if (fabs(f) >= fabs(x)) {
+				comp += (f - t) + x;
+			} else {
+				comp += (x - t) + f;
+			}
+			f = t;
+		}
+		return DBL2NUM(f + comp);
 
-	if (rb_block_given_p()) {
-		hash = list_make_hash_by(self);
-	} else {
-		hash = list_make_hash(self);
+	  not_float:
+		v = DBL2NUM(f);
+	}
+	goto has_some_value;
+
+  init_is_a_value:
+	for (; c; c = c->next) {
+		e = block_given ? rb_yield(c->value) : c->value;
+	  has_some_value:
+		v = rb_funcall(v, '+', 1, e);
 	}
-	uniq = list_hash_values(hash);
-	return uniq;
+	return v;
 }
 
-static VALUE
-list_uniq_bang(VALUE self)
+/* memo + v without dispatch for Fixnums and Floats */
+static inline VALUE
+inject_plus(struct cmp_opt *opt, VALUE memo, VALUE v)
 {
-	long len;
+	if (FIXNUM_P(memo) && FIXNUM_P(v) &&
+	    cmp_opt_basic_p(opt, CMP_OPT_INTEGER, rb_cInteger, '+')) {
+		return LONG2NUM(FIX2LONG(memo) + FIX2LONG(v));
+	}
+	if (RB_FLOAT_TYPE_P(memo) && RB_FLOAT_TYPE_P(v) &&
+	    cmp_opt_basic_p(opt, CMP_OPT_FLOAT, rb_cFloat, '+')) {
+		return DBL2NUM(RFLOAT_VALUE(memo) + RFLOAT_VALUE(v));
+	}
+	return rb_funcallv_public(memo, '+', 1, &v);
+}
 
-	list_modify_check(self);
-	len = LIST_LEN(self);
-	if (len <= 1)
-		return Qnil;
+static VALUE
+list_inject(int argc, VALUE *argv, VALUE self)
+{
+	struct cmp_opt opt = CMP_OPT_INIT;
+	VALUE memo = Qundef, op = Qnil;
+	item_t *c;
+	ID id = 0;
 
-	list_replace(self, list_uniq(self));
-	if (len == LIST_LEN(self)) {
-		return Qnil;
+	switch (rb_scan_args(argc, argv, "02", &memo, &op)) {
+	case 0:
+		memo = Qundef;
+		break;
+	case 1:
+		if (rb_block_given_p()) break;
+		id = rb_to_id(memo);
+		memo = Qundef;
+		break;
+	case 2:
+		if (rb_block_given_p()) {
+			rb_warning("given block not used");
+		}
+		id = rb_to_id(op);
+		break;
 	}
-
-	return self;
+	LIST_FOR(self, c) {
+		if (memo == Qundef) {
+			memo = c->value;
+		} else if (!id) {
+			memo = rb_yield_values(2, memo, c->value);
+		} else if (id == '+') {
+			memo = inject_plus(&opt, memo, c->value);
+		} else {
+			memo = rb_funcallv_public(memo, id, 1, &c->value);
+		}
+	}
+	return memo == Qundef ? Qnil : memo;
 }
 
 static VALUE
-list_compact_bang(VALUE self)
+list_min_max_by(int argc, VALUE *argv, VALUE self, int sign)
 {
-	long len;
+	VALUE ary;
 
-	list_modify_check(self);
-	len = LIST_LEN(self);
-	list_delete(self, Qnil);
-	if (len == LIST_LEN(self)) {
-		return Qnil;
+	RETURN_SIZED_ENUMERATOR(self, argc, argv, list_enum_length);
+	if (rb_check_arity(argc, 0, 1) && !NIL_P(argv[0])) {
+		return list_topk(self, NUM2LONG(argv[0]), sign, TRUE);
 	}
-	return self;
+	ary = list_topk(self, 1, sign, TRUE);
+	return rb_ary_entry(ary, 0);
 }
 
 static VALUE
-list_compact(VALUE self)
+list_min_by(int argc, VALUE *argv, VALUE self)
 {
-	self = list_dup(self);
-	list_compact_bang(self);
-	return self;
+	return list_min_max_by(argc, argv, self, 1);
 }
 
 static VALUE
-list_make_shared_copy(VALUE list)
+list_max_by(int argc, VALUE *argv, VALUE self)
 {
-	return list_make_partial(list, rb_obj_class(list), 0, LIST_LEN(list));
+	return list_min_max_by(argc, argv, self, -1);
 }
 
 static VALUE
-flatten(VALUE list, int level, int *modified)
+list_random_opt(int argc, VALUE *argv, VALUE *nv)
 {
-	VALUE stack, result;
-	VALUE val;
-	list_t *ptr, *pv;
-	item_t *c;
+	static ID keyword_ids[1];
+	VALUE opts, randgen = rb_cRandom;
 
-	*modified = 0;
-	stack = rb_ary_new();
-	result = list_new();
-	Data_Get_Struct(list, list_t, ptr);
-	c = ptr->first;
-	while (1) {
-		while (c) {
-			val = check_list_type(c->value);
-			if (NIL_P(val) || (0 <= level && level <= RARRAY_LEN(stack))) {
-				list_push(result, c->value);
-				c = c->next;
-			} else {
-				*modified = 1;
-				rb_ary_push(stack, (VALUE)c); /* stack address */
-				Data_Get_Struct(val, list_t, pv);
-				c = pv->first;
-			}
-		}
-		if (RARRAY_LEN(stack) == 0) {
-			break;
-		}
-		c = (item_t *)rb_ary_pop(stack); /* pop address */
-		c = c->next;
+	if (!keyword_ids[0]) keyword_ids[0] = rb_intern("random");
+	if (nv) {
+		rb_scan_args(argc, argv, "01:", nv, &opts);
+	} else {
+		rb_scan_args(argc, argv, "0:", &opts);
 	}
-
-	return result;
+	if (!NIL_P(opts)) {
+		rb_get_kwargs(opts, keyword_ids, 0, 1, &randgen);
+		if (randgen == Qundef) randgen = rb_cRandom;
+	}
+	return randgen;
 }
 
+struct shuffle_arg {
+	VALUE self;
+	VALUE tmp;
+	VALUE randgen;
+	item_t **items;
+	long len;
+};
+
 static VALUE
-list_flatten(int argc, VALUE *argv, VALUE self)
+shuffle_i(VALUE arg)
 {
-	int mod = 0, level = -1;
-	VALUE result, lv;
-
-	rb_scan_args(argc, argv, "01", &lv);
-	if (!NIL_P(lv)) level = NUM2INT(lv);
-	if (level == 0) return list_make_shared_copy(self);
-
-	result = flatten(self, level, &mod);
-	OBJ_INFECT(result, self);
+	struct shuffle_arg *s = (struct shuffle_arg *)arg;
+	item_t **items = s->items, *c;
+	list_t *ptr;
+	long len = s->len, i = len, j;
 
-	return result;
+	while (i) {
+		j = (long)rb_random_ulong_limited(s->randgen, i - 1);
+		c = items[--i];
+		items[i] = items[j];
+		items[j] = c;
+	}
+	for (i = 0; i < len - 1; i++) {
+		items[i]->next = items[i + 1];
+	}
+	items[len - 1]->next = NULL;
+	ptr = LIST_PTR(s->tmp);
+	ptr->first = items[0];
+	ptr->last = items[len - 1];
+	if (LIST_LEN(s->self) != 0) {
+		rb_raise(rb_eRuntimeError, "modified during shuffle");
+	}
+	return Qnil;
 }
 
+/* the items go back to self even when randgen raises */
 static VALUE
-list_flatten_bang(int argc, VALUE *argv, VALUE self)
+shuffle_ensure(VALUE arg)
 {
-	int mod = 0, level = -1;
-	VALUE result, lv;
-
-	rb_scan_args(argc, argv, "01", &lv);
-	list_modify_check(self);
-	if (!NIL_P(lv)) level = NUM2INT(lv);
-	if (level == 0) return Qnil;
+	struct shuffle_arg *s = (struct shuffle_arg *)arg;
 
-	result = flatten(self, level, &mod);
-	if (mod == 0) {
-		return Qnil;
-	}
-	list_replace(self, result);
-	return self;
+	list_steal(s->self, s->tmp);
+	return Qnil;
 }
 
-static VALUE
-list_count(int argc, VALUE *argv, VALUE self)
+/* Fisher-Yates over the item pointers, in the same order as Array#shuffle!.
+ * The chain is detached meanwhile since randgen may run Ruby code. */
+static void
+list_shuffle_chain(VALUE self, VALUE randgen)
 {
-	VALUE obj;
+	struct shuffle_arg s;
+	VALUE buf;
 	item_t *c;
-	long n = 0;
-
-	if (argc == 0) {
-		if (!rb_block_given_p()) {
-			return list_length(self);
-		}
-		LIST_FOR(self,c) {
-			if (RTEST(rb_yield(c->value))) n++;
-		}
-	} else {
-		rb_scan_args(argc, argv, "1", &obj);
-		if (rb_block_given_p()) {
-			rb_warn("given block not used");
-		}
-		LIST_FOR(self,c) {
-			if (rb_equal(c->value, obj)) n++;
-		}
+	long len = LIST_LEN(self), i;
+
+	if (len <= 1) return;
+	s.self = self;
+	s.randgen = randgen;
+	s.len = len;
+	s.tmp = list_detach(self, 0, len);
+	s.items = ALLOCV_N(item_t *, buf, len);
+	i = 0;
+	LIST_FOR(s.tmp, c) {
+		s.items[i++] = c;
 	}
-	return LONG2NUM(n);
+	rb_ensure(shuffle_i, (VALUE)&s, shuffle_ensure, (VALUE)&s);
+	ALLOCV_END(buf);
+	RB_GC_GUARD(s.tmp);
+}
+
+static VALUE
+list_shuffle_bang(int argc, VALUE *argv, VALUE self)
+{
+	VALUE randgen = list_random_opt(argc, argv, NULL);
+
+	list_modify_check(self);
+	list_shuffle_chain(self, randgen);
+	return self;
 }
 
 static VALUE
 list_shuffle(int argc, VALUE *argv, VALUE self)
 {
-	return list_delegate_rb(argc, argv, self, rb_intern("shuffle"));
+	VALUE randgen = list_random_opt(argc, argv, NULL);
+	VALUE result = list_dup(self);
+
+	list_shuffle_chain(result, randgen);
+	return result;
+}
+
+static int
+sample_index_cmp(const void *a, const void *b, void *idx)
+{
+	long x = ((long *)idx)[*(const long *)a], y = ((long *)idx)[*(const long *)b];
+
+	return (x > y) - (x < y);
 }
 
-static VALUE
-list_shuffle_bang(int argc, VALUE *argv, VALUE self)
+/* 1 - rand in (0, 1], so that its log is finite */
+static inline double
+sample_real(VALUE randgen)
 {
-	return list_replace(self, list_shuffle(argc, argv, self));
+	return 1.0 - rb_random_real(randgen);
 }
 
+/* reservoir sampling with geometric skips (Li's algorithm L): the indexes
+ * are drawn first, then the chain is walked once to pick the items */
 static VALUE
 list_sample(int argc, VALUE *argv, VALUE self)
 {
-	return list_delegate_rb(argc, argv, self, rb_intern("sample"));
+	VALUE nv = Qnil, randgen, ary, buf, result;
+	long n, len, k, i, j, *idx, *order;
+	double w, skip;
+	item_t *c;
+
+	randgen = list_random_opt(argc, argv, &nv);
+	len = LIST_LEN(self);
+	if (NIL_P(nv)) {
+		if (len == 0) return Qnil;
+		i = (long)rb_random_ulong_limited(randgen, len - 1);
+		return list_elt(self, i);
+	}
+	n = NUM2LONG(nv);
+	if (n < 0) rb_raise(rb_eArgError, "negative sample number");
+	k = n < len ? n : len;
+	if (k == 0) return list_new();
+
+	idx = ALLOCV_N(long, buf, k * 2);
+	order = idx + k;
+	for (i = 0; i < k; i++) {
+		idx[i] = order[i] = i;
+	}
+	if (k < len) {
+		w = exp(log(sample_real(randgen)) / k);
+		i = k - 1;
+		for (;;) {
+			skip = floor(log(sample_real(randgen)) / log1p(-w));
+			if (!(i + 1 + skip < len)) break;
+			i += 1 + (long)skip;
+			idx[rb_random_ulong_limited(randgen, k - 1)] = i;
+			w *= exp(log(sample_real(randgen)) / k);
+		}
+		ruby_qsort(order, k, sizeof(long), sample_index_cmp, idx);
+	}
+
+	ary = rb_ary_new2(k);
+	c = LIST_PTR(self)->first;
+	for (i = 0, j = 0; j < k && c; c = c->next, i++) {
+		if (i == idx[order[j]]) {
+			rb_ary_store(ary, order[j++], c->value);
+		}
+	}
+	ALLOCV_END(buf);
+	result = to_list(ary);
+	list_shuffle_chain(result, randgen);
+	return result;
 }
 
 static VALUE
@@ -2336,34 +6091,229 @@ list_cycle(int argc, VALUE *argv, VALUE self)
 	return Qnil;
 }
 
+/* combinatorics walk index vectors over a snapshot of the items and yield
+ * a fresh Array for each result, in the same order as Array does */
+
+enum comb_kind {
+	COMB_PERMUTATION,
+	COMB_COMBINATION,
+	COMB_REPEATED_PERMUTATION,
+	COMB_REPEATED_COMBINATION
+};
+
+static VALUE
+descending_factorial(long from, long how_many)
+{
+	VALUE cnt = LONG2FIX(0 <= how_many);
+
+	while (0 < how_many--) {
+		cnt = rb_funcall(cnt, '*', 1, LONG2NUM(from--));
+	}
+	return cnt;
+}
+
+static VALUE
+binomial_coefficient(long comb, long size)
+{
+	if (size - comb < comb) comb = size - comb;
+	if (comb < 0) return LONG2FIX(0);
+	if (comb == 0) return LONG2FIX(1);
+	return rb_funcall(descending_factorial(size, comb), '/', 1, descending_factorial(comb, comb));
+}
+
+static long
+comb_arg(VALUE self, VALUE args)
+{
+	if (args && 0 < RARRAY_LEN(args) && !NIL_P(RARRAY_AREF(args, 0))) {
+		return NUM2LONG(RARRAY_AREF(args, 0));
+	}
+	return LIST_LEN(self);
+}
+
+static VALUE
+list_permutation_size(VALUE self, VALUE args, VALUE eobj)
+{
+	return descending_factorial(LIST_LEN(self), comb_arg(self, args));
+}
+
+static VALUE
+list_combination_size(VALUE self, VALUE args, VALUE eobj)
+{
+	return binomial_coefficient(comb_arg(self, args), LIST_LEN(self));
+}
+
+static VALUE
+list_repeated_permutation_size(VALUE self, VALUE args, VALUE eobj)
+{
+	long r = comb_arg(self, args);
+
+	if (r < 0) return LONG2FIX(0);
+	return rb_funcall(LONG2NUM(LIST_LEN(self)), rb_intern("**"), 1, LONG2NUM(r));
+}
+
+static VALUE
+list_repeated_combination_size(VALUE self, VALUE args, VALUE eobj)
+{
+	long r = comb_arg(self, args);
+
+	if (r == 0) return LONG2FIX(1);
+	return binomial_coefficient(r, LIST_LEN(self) + r - 1);
+}
+
+/* step p to the next index vector, false after the last one */
+static int
+comb_next(enum comb_kind kind, long *p, char *used, long n, long r)
+{
+	long i = r - 1, j;
+
+	switch (kind) {
+	case COMB_PERMUTATION:
+		for (; 0 <= i; i--) {
+			used[p[i]] = 0;
+			for (j = p[i] + 1; j < n && used[j]; j++);
+			if (j == n) continue;
+			p[i] = j;
+			used[j] = 1;
+			for (i++, j = 0; i < r; i++) {
+				while (used[j]) j++;
+				p[i] = j;
+				used[j] = 1;
+			}
+			return TRUE;
+		}
+		return FALSE;
+	case COMB_COMBINATION:
+		while (0 <= i && p[i] == n - r + i) i--;
+		if (i < 0) return FALSE;
+		p[i]++;
+		for (j = i + 1; j < r; j++) p[j] = p[j - 1] + 1;
+		return TRUE;
+	case COMB_REPEATED_PERMUTATION:
+		while (0 <= i && ++p[i] == n) p[i--] = 0;
+		return 0 <= i;
+	case COMB_REPEATED_COMBINATION:
+		while (0 <= i && p[i] == n - 1) i--;
+		if (i < 0) return FALSE;
+		p[i]++;
+		for (j = i + 1; j < r; j++) p[j] = p[i];
+		return TRUE;
+	}
+	return FALSE;
+}
+
+static void
+list_comb_each(VALUE self, long r, enum comb_kind kind)
+{
+	volatile VALUE values = list_to_a(self);
+	VALUE buf, ary;
+	long n = RARRAY_LEN(values), *p, i;
+	char *used;
+
+	if (r < 0) return;
+	if (r == 0) {
+		rb_yield(rb_ary_new2(0));
+		return;
+	}
+	if (kind < COMB_REPEATED_PERMUTATION ? n < r : n == 0) return;
+	p = (long *)ALLOCV(buf, r * sizeof(long) + n);
+	used = (char *)(p + r);
+	MEMZERO(used, char, n);
+	for (i = 0; i < r; i++) {
+		p[i] = kind < COMB_REPEATED_PERMUTATION ? i : 0;
+		if (kind == COMB_PERMUTATION) used[i] = 1;
+	}
+	do {
+		ary = rb_ary_new2(r);
+		for (i = 0; i < r; i++) {
+			rb_ary_push(ary, RARRAY_AREF(values, p[i]));
+		}
+		rb_yield(ary);
+	} while (comb_next(kind, p, used, n, r));
+	ALLOCV_END(buf);
+	RB_GC_GUARD(values);
+}
+
 static VALUE
 list_permutation(int argc, VALUE *argv, VALUE self)
 {
-	return list_delegate_rb(argc, argv, self, rb_intern("permutation"));
+	long r;
+
+	RETURN_SIZED_ENUMERATOR(self, argc, argv, list_permutation_size);
+	r = rb_check_arity(argc, 0, 1) && !NIL_P(argv[0]) ? NUM2LONG(argv[0]) : LIST_LEN(self);
+	list_comb_each(self, r, COMB_PERMUTATION);
+	return self;
 }
 
 static VALUE
 list_combination(VALUE self, VALUE num)
 {
-	return list_delegate_rb(1, &num, self, rb_intern("combination"));
+	RETURN_SIZED_ENUMERATOR(self, 1, &num, list_combination_size);
+	list_comb_each(self, NUM2LONG(num), COMB_COMBINATION);
+	return self;
 }
 
 static VALUE
 list_repeated_permutation(VALUE self, VALUE num)
 {
-	return list_delegate_rb(1, &num, self, rb_intern("repeated_permutation"));
+	RETURN_SIZED_ENUMERATOR(self, 1, &num, list_repeated_permutation_size);
+	list_comb_each(self, NUM2LONG(num), COMB_REPEATED_PERMUTATION);
+	return self;
 }
 
 static VALUE
 list_repeated_combination(VALUE self, VALUE num)
 {
-	return list_delegate_rb(1, &num, self, rb_intern("repeated_combination"));
+	RETURN_SIZED_ENUMERATOR(self, 1, &num, list_repeated_combination_size);
+	list_comb_each(self, NUM2LONG(num), COMB_REPEATED_COMBINATION);
+	return self;
 }
 
+/* an odometer over snapshots of self and the lists */
 static VALUE
 list_product(int argc, VALUE *argv, VALUE self)
 {
-	return list_delegate_rb(argc, argv, self, rb_intern("product"));
+	volatile VALUE snaps = rb_ary_new2(argc + 1);
+	VALUE result = Qnil, buf, ary, values;
+	long n = argc + 1, *p, i, resultlen = 1, len;
+	int block_given = rb_block_given_p();
+
+	rb_ary_push(snaps, list_to_a(self));
+	for (i = 0; i < argc; i++) {
+		rb_ary_push(snaps, list_to_a(to_list(argv[i])));
+	}
+	for (i = 0; i < n; i++) {
+		len = RARRAY_LEN(RARRAY_AREF(snaps, i));
+		if (len == 0) resultlen = 0;
+		else if (!block_given && resultlen && LONG_MAX / len < resultlen) {
+			rb_raise(rb_eRangeError, "too big to product");
+		} else {
+			resultlen *= len;
+		}
+	}
+	if (!block_given) result = list_new();
+	if (resultlen == 0) return block_given ? self : result;
+
+	p = ALLOCV_N(long, buf, n);
+	MEMZERO(p, long, n);
+	do {
+		ary = rb_ary_new2(n);
+		for (i = 0; i < n; i++) {
+			rb_ary_push(ary, RARRAY_AREF(RARRAY_AREF(snaps, i), p[i]));
+		}
+		if (block_given) {
+			rb_yield(ary);
+		} else {
+			list_push_item(result, ary);
+		}
+		for (i = n - 1; 0 <= i; i--) {
+			values = RARRAY_AREF(snaps, i);
+			if (++p[i] < RARRAY_LEN(values)) break;
+			p[i] = 0;
+		}
+	} while (0 <= i);
+	ALLOCV_END(buf);
+	RB_GC_GUARD(snaps);
+	return block_given ? self : result;
 }
 
 static VALUE
@@ -2384,7 +6334,7 @@ list_take_while(VALUE self)
 	long i = 0;
 
 	RETURN_ENUMERATOR(self, 0, 0);
-	LIST_FOR(self, c) {
+	LIST_FOR_LAZY(self, c) {
 		if (!RTEST(rb_yield(c->value))) break;
 		i++;
 	}
@@ -2479,7 +6429,7 @@ list_ring_bang(VALUE self)
 {
 	list_t *ptr;
 
-	Data_Get_Struct(self, list_t, ptr);
+	ptr = LIST_PTR(self);
 	if (ptr->first == NULL)
 		rb_raise(rb_eRuntimeError, "length is zero list cannot to change ring");
 	rb_obj_freeze(self);
@@ -2519,6 +6469,466 @@ list_pack(VALUE self, VALUE str)
 	return list_delegate_rb(1, &str, self, rb_intern("pack"));
 }
 
+/*
+ * List::Sorted keeps its items ordered by <=>.
+ * Lookups go through a skip list whose nodes point at items of the chain;
+ * the chain itself is the bottom lane, so in-order iteration is unchanged.
+ * The index is built on first use and dropped by any List mutator, which
+ * makes it rebuilt (and the chain resorted if needed) on the next query.
+ */
+
+static unsigned int skip_seed = 2463534242U;
+
+static int
+skip_random_height(void)
+{
+	int h = 0;
+
+	do {
+		skip_seed ^= skip_seed << 13;
+		skip_seed ^= skip_seed >> 17;
+		skip_seed ^= skip_seed << 5;
+		if (skip_seed & 3) break;
+	} while (++h < SKIP_MAX_LEVEL);
+	return h;
+}
+
+static skip_node_t *
+skip_node_new(item_t *item, int height)
+{
+	skip_node_t *node;
+
+	node = xmalloc(sizeof(skip_node_t) + (height - 1) * sizeof(struct skip_lane));
+	node->item = item;
+	return node;
+}
+
+static unsigned long skip_serial;
+
+static void
+skip_index_free(list_t *ptr)
+{
+	skip_index_t *idx = ptr->skip;
+	skip_node_t *node, *next;
+
+	ptr->skip = NULL;
+	for (node = idx->head; node; node = next) {
+		next = node->lane[0].next;
+		xfree(node);
+	}
+	xfree(idx);
+}
+
+static int
+sorted_cmp_opt(struct cmp_opt *opt, VALUE a, VALUE b)
+{
+	int r;
+
+	if (!optimized_cmp(opt, a, b, &r)) {
+		r = rb_cmpint(rb_funcall(a, id_cmp, 1, b), a, b);
+	}
+	return r;
+}
+
+/* every 4^k-th item gets k lanes, which is what random heights average to */
+static skip_index_t *
+skip_index_build(VALUE self)
+{
+	struct cmp_opt opt = CMP_OPT_INIT;
+	skip_node_t *last[SKIP_MAX_LEVEL], *node;
+	long lastpos[SKIP_MAX_LEVEL];
+	list_t *ptr = LIST_PTR(self);
+	skip_index_t *idx;
+	item_t *c, *first = ptr->first;
+	long pos, p, len = LIST_PTR_LEN(ptr);
+	int h, i, cmp;
+
+	for (c = ptr->first; c && c->next; c = c->next) {
+		cmp = sorted_cmp_opt(&opt, c->value, c->next->value);
+		if (ptr->first != first || LIST_PTR_LEN(ptr) != len) {
+			rb_raise(rb_eRuntimeError, "list modified during <=>");
+		}
+		if (0 < cmp) {
+			list_sort_chain(self, SORT_CMP);
+			break;
+		}
+	}
+	if (ptr->skip) return ptr->skip;
+
+	idx = ALLOC(skip_index_t);
+	idx->serial = ++skip_serial;
+	idx->head = skip_node_new(NULL, SKIP_MAX_LEVEL);
+	idx->level = 0;
+	for (i = 0; i < SKIP_MAX_LEVEL; i++) {
+		idx->head->lane[i].next = NULL;
+		idx->head->lane[i].span = 0;
+		last[i] = idx->head;
+		lastpos[i] = 0;
+	}
+	for (c = ptr->first, pos = 1; c; c = c->next, pos++) {
+		for (h = 0, p = pos; h < SKIP_MAX_LEVEL && (p & 3) == 0; p >>= 2) h++;
+		if (h == 0) continue;
+		node = skip_node_new(c, h);
+		for (i = 0; i < h; i++) {
+			last[i]->lane[i].next = node;
+			last[i]->lane[i].span = pos - lastpos[i];
+			node->lane[i].next = NULL;
+			last[i] = node;
+			lastpos[i] = pos;
+		}
+		if (idx->level < h) idx->level = h;
+	}
+	ptr->skip = idx;
+	return idx;
+}
+
+static inline skip_index_t *
+sorted_index(VALUE self)
+{
+	list_t *ptr = LIST_PTR(self);
+
+	return ptr->skip ? ptr->skip : skip_index_build(self);
+}
+
+/* <=> may change the list, which drops or rewires the index */
+static void
+sorted_modified_check(VALUE self, skip_index_t *idx, unsigned long serial, const char *op)
+{
+	rb_check_frozen(self);
+	if (LIST_RAW_PTR(self)->skip != idx || idx->serial != serial) {
+		rb_raise(rb_eRuntimeError, "list modified during %s", op);
+	}
+}
+
+/*
+ * find the place of v: before the items equal to it, or after them with upper.
+ * update[i] and rank[i] get the last node of lane i before the place and its
+ * position; returns the last item before the place, NULL for none.
+ */
+static item_t *
+skip_search(VALUE self, struct cmp_opt *opt, VALUE v, int upper,
+		skip_node_t **update, long *rank, long *pos)
+{
+	skip_index_t *idx = sorted_index(self);
+	unsigned long serial = idx->serial;
+	skip_node_t *x = idx->head, *n;
+	item_t *prev, *c;
+	long r = 0;
+	int i, cmp;
+
+	for (i = idx->level - 1; 0 <= i; i--) {
+		while ((n = x->lane[i].next) != NULL) {
+			cmp = sorted_cmp_opt(opt, n->item->value, v);
+			sorted_modified_check(self, idx, serial, "search");
+			if (upper ? 0 < cmp : 0 <= cmp) break;
+			r += x->lane[i].span;
+			x = n;
+		}
+		if (update) {
+			update[i] = x;
+			rank[i] = r;
+		}
+	}
+	prev = x->item;
+	c = prev ? prev->next : LIST_PTR(self)->first;
+	while (c) {
+		cmp = sorted_cmp_opt(opt, c->value, v);
+		sorted_modified_check(self, idx, serial, "search");
+		if (upper ? 0 < cmp : 0 <= cmp) break;
+		prev = c;
+		c = c->next;
+		r++;
+	}
+	if (pos) *pos = r;
+	return prev;
+}
+
+static VALUE
+list_sorted_add(VALUE self, VALUE v)
+{
+	struct cmp_opt opt = CMP_OPT_INIT;
+	skip_node_t *update[SKIP_MAX_LEVEL], *node = NULL;
+	long rank[SKIP_MAX_LEVEL], pos;
+	list_t *ptr;
+	skip_index_t *idx;
+	item_t *prev, *c;
+	int h, i;
+
+	rb_check_frozen(self);
+	prev = skip_search(self, &opt, v, TRUE, update, rank, &pos);
+	ptr = LIST_PTR(self);
+	idx = ptr->skip;
+	idx->serial = ++skip_serial;
+	h = skip_random_height();
+	c = item_alloc(v, prev ? prev->next : ptr->first);
+	if (h) node = skip_node_new(c, h);
+
+	if (prev) {
+		prev->next = c;
+	} else {
+		ptr->first = c;
+	}
+	if (c->next == NULL) ptr->last = c;
+	LIST_PTR_LEN(ptr)++;
+
+	for (i = idx->level; i < h; i++) {
+		update[i] = idx->head;
+		rank[i] = 0;
+	}
+	if (idx->level < h) idx->level = h;
+	for (i = 0; i < idx->level; i++) {
+		if (i < h) {
+			node->lane[i].next = update[i]->lane[i].next;
+			node->lane[i].span = update[i]->lane[i].span - (pos - rank[i]);
+			update[i]->lane[i].next = node;
+			update[i]->lane[i].span = pos + 1 - rank[i];
+		} else {
+			update[i]->lane[i].span++;
+		}
+	}
+	return self;
+}
+
+static VALUE
+list_sorted_delete(VALUE self, VALUE v)
+{
+	struct cmp_opt opt = CMP_OPT_INIT;
+	skip_node_t *update[SKIP_MAX_LEVEL], *n, *node;
+	long rank[SKIP_MAX_LEVEL];
+	unsigned long serial;
+	list_t *ptr;
+	skip_index_t *idx;
+	item_t *prev, *c;
+	VALUE deleted = Qundef;
+	int i;
+
+	rb_check_frozen(self);
+	prev = skip_search(self, &opt, v, FALSE, update, rank, NULL);
+	ptr = LIST_PTR(self);
+	idx = ptr->skip;
+	serial = idx->serial;
+	while ((c = prev ? prev->next : ptr->first) != NULL) {
+		if (sorted_cmp_opt(&opt, c->value, v) != 0) break;
+		sorted_modified_check(self, idx, serial, "delete");
+		serial = idx->serial = ++skip_serial;
+		node = NULL;
+		for (i = 0; i < idx->level; i++) {
+			n = update[i]->lane[i].next;
+			if (n && n->item == c) {
+				update[i]->lane[i].span += n->lane[i].span - 1;
+				update[i]->lane[i].next = n->lane[i].next;
+				node = n;
+			} else {
+				update[i]->lane[i].span--;
+			}
+		}
+		if (node) xfree(node);
+		while (0 < idx->level && idx->head->lane[idx->level - 1].next == NULL) {
+			idx->level--;
+		}
+		deleted = c->value;
+		list_unlink(ptr, prev, c);
+	}
+	if (deleted != Qundef) return deleted;
+	if (rb_block_given_p()) return rb_yield(v);
+	return Qnil;
+}
+
+static VALUE
+list_sorted_include_p(VALUE self, VALUE v)
+{
+	struct cmp_opt opt = CMP_OPT_INIT;
+	item_t *prev, *c;
+
+	prev = skip_search(self, &opt, v, FALSE, NULL, NULL, NULL);
+	c = prev ? prev->next : LIST_PTR(self)->first;
+	if (c && sorted_cmp_opt(&opt, c->value, v) == 0) return Qtrue;
+	return Qfalse;
+}
+
+static VALUE
+list_sorted_rank(VALUE self, VALUE v)
+{
+	struct cmp_opt opt = CMP_OPT_INIT;
+	long pos;
+
+	skip_search(self, &opt, v, FALSE, NULL, NULL, &pos);
+	return LONG2NUM(pos);
+}
+
+static VALUE
+list_sorted_between(VALUE self, VALUE lo, VALUE hi)
+{
+	struct cmp_opt opt = CMP_OPT_INIT;
+	VALUE result;
+	skip_index_t *idx;
+	unsigned long serial;
+	item_t *prev, *c;
+	int cmp;
+
+	result = rb_obj_alloc(rb_obj_class(self));
+	prev = skip_search(self, &opt, lo, FALSE, NULL, NULL, NULL);
+	idx = LIST_RAW_PTR(self)->skip;
+	serial = idx->serial;
+	for (c = prev ? prev->next : LIST_PTR(self)->first; c; c = c->next) {
+		cmp = sorted_cmp_opt(&opt, c->value, hi);
+		sorted_modified_check(self, idx, serial, "between");
+		if (0 < cmp) break;
+		list_push_item(result, c->value);
+	}
+	return result;
+}
+
+/* TRUE while the block says the target lies further on */
+static int
+sorted_bsearch_right(VALUE v, int *any, int *hit)
+{
+	VALUE ret = rb_yield(v);
+
+	*hit = 0;
+	if (ret == Qtrue) return FALSE;
+	if (NIL_P(ret) || ret == Qfalse) return TRUE;
+	if (rb_obj_is_kind_of(ret, rb_cNumeric)) {
+		int cmp = rb_cmpint(rb_funcall(ret, id_cmp, 1, INT2FIX(0)), ret, INT2FIX(0));
+
+		*any = 1;
+		*hit = (cmp == 0);
+		return 0 < cmp;
+	}
+	rb_raise(rb_eTypeError, "wrong argument type %"PRIsVALUE" (must be numeric, true, false or nil)",
+			rb_obj_class(ret));
+	UNREACHABLE_RETURN(FALSE);
+}
+
+static VALUE
+list_sorted_bsearch(VALUE self)
+{
+	skip_index_t *idx;
+	skip_node_t *x, *n;
+	unsigned long serial;
+	item_t *c;
+	int i, right, any = 0, hit = 0;
+
+	RETURN_ENUMERATOR(self, 0, 0);
+	idx = sorted_index(self);
+	x = idx->head;
+	serial = idx->serial;
+	for (i = idx->level - 1; 0 <= i; i--) {
+		while ((n = x->lane[i].next) != NULL) {
+			right = sorted_bsearch_right(n->item->value, &any, &hit);
+			sorted_modified_check(self, idx, serial, "bsearch");
+			if (!right) break;
+			x = n;
+		}
+	}
+	c = x->item ? x->item->next : LIST_PTR(self)->first;
+	while (c) {
+		right = sorted_bsearch_right(c->value, &any, &hit);
+		sorted_modified_check(self, idx, serial, "bsearch");
+		if (!right) break;
+		c = c->next;
+	}
+	if (c == NULL || (any && !hit)) return Qnil;
+	return c->value;
+}
+
+static VALUE
+list_sorted_s_create(int argc, VALUE *argv, VALUE klass)
+{
+	VALUE list = list_s_create(argc, argv, klass);
+
+	list_sort_chain(list, SORT_CMP);
+	return list;
+}
+
+static VALUE
+list_sorted_initialize(int argc, VALUE *argv, VALUE self)
+{
+	list_initialize(argc, argv, self);
+	list_sort_chain(self, SORT_CMP);
+	return self;
+}
+
+static VALUE
+list_sorted_replace(VALUE self, VALUE orig)
+{
+	list_replace(self, orig);
+	list_sort_chain(self, SORT_CMP);
+	return self;
+}
+
+/* methods whose result is not in order give plain Lists */
+
+static VALUE
+list_sorted_collect(VALUE self)
+{
+	return list_collect_bang(list_dup(self));
+}
+
+static VALUE
+list_sorted_rotate(int argc, VALUE *argv, VALUE self)
+{
+	return list_rotate_bang(argc, argv, list_dup(self));
+}
+
+static VALUE
+list_sorted_times(VALUE self, VALUE times)
+{
+	return list_times(list_dup(self), times);
+}
+
+static VALUE
+list_sorted_sort(VALUE self)
+{
+	VALUE result = list_dup(self);
+
+	if (rb_block_given_p()) {
+		list_sort_chain(result, SORT_BLOCK);
+	}
+	return result;
+}
+
+static void
+Init_list_sorted(void)
+{
+	static const char *const order_breakers[] = {
+		"push", "unshift", "insert", "[]=", "concat", "concat!", "append_list!",
+		"fill", "reverse!", "rotate!", "shuffle!", "sort!", "sort_by!",
+		"sort_external!", "merge", "merge!",
+		"collect!", "map!", "flatten!", "ring", "ring!"
+	};
+	/* these would build a Sorted from items in any order */
+	static const char *const unordered_builders[] = {
+		"lazy_new", "concat_all", "merge_all"
+	};
+	size_t i;
+
+	cListSorted = rb_define_class_under(cList, "Sorted", cList);
+	rb_define_singleton_method(cListSorted, "[]", list_sorted_s_create, -1);
+	rb_define_method(cListSorted, "initialize", list_sorted_initialize, -1);
+	rb_define_method(cListSorted, "replace", list_sorted_replace, 1);
+
+	rb_define_method(cListSorted, "add", list_sorted_add, 1);
+	rb_define_alias(cListSorted, "<<", "add");
+	rb_define_method(cListSorted, "delete", list_sorted_delete, 1);
+	rb_define_method(cListSorted, "include?", list_sorted_include_p, 1);
+	rb_define_method(cListSorted, "rank", list_sorted_rank, 1);
+	rb_define_method(cListSorted, "between", list_sorted_between, 2);
+	rb_define_method(cListSorted, "bsearch", list_sorted_bsearch, 0);
+
+	rb_define_method(cListSorted, "collect", list_sorted_collect, 0);
+	rb_define_method(cListSorted, "map", list_sorted_collect, 0);
+	rb_define_method(cListSorted, "rotate", list_sorted_rotate, -1);
+	rb_define_method(cListSorted, "*", list_sorted_times, 1);
+	rb_define_method(cListSorted, "sort", list_sorted_sort, 0);
+	for (i = 0; i < sizeof(order_breakers) / sizeof(order_breakers[0]); i++) {
+		rb_undef_method(cListSorted, order_breakers[i]);
+	}
+	for (i = 0; i < sizeof(unordered_builders) / sizeof(unordered_builders[0]); i++) {
+		rb_undef_method(rb_singleton_class(cListSorted), unordered_builders[i]);
+	}
+}
+
 void
 Init_list(void)
 {
@@ -2529,6 +6939,9 @@ Init_list(void)
 
 	rb_define_singleton_method(cList, "[]", list_s_create, -1);
 	rb_define_singleton_method(cList, "try_convert", list_s_try_convert, 1);
+	rb_define_singleton_method(cList, "lazy_new", list_s_lazy_new, 1);
+	rb_define_singleton_method(cList, "concat_all", list_s_concat_all, 1);
+	rb_define_singleton_method(cList, "merge_all", list_s_merge_all, -1);
 
 	rb_define_method(cList, "initialize", list_initialize, -1);
 	rb_define_method(cList, "initialize_copy", list_replace, 1);
@@ -2540,6 +6953,7 @@ Init_list(void)
 	rb_define_method(cList, "frozen?", list_frozen_p, 0);
 
 	rb_define_method(cList, "==", list_equal, 1);
+	rb_define_method(cList, "eql?", list_eql, 1);
 	rb_define_method(cList, "hash", list_hash, 0);
 
 	rb_define_method(cList, "[]", list_aref, -1);
@@ -2549,6 +6963,8 @@ Init_list(void)
 	rb_define_method(cList, "first", list_first, -1);
 	rb_define_method(cList, "last", list_last, -1);
 	rb_define_method(cList, "concat", list_concat, 1);
+	rb_define_method(cList, "concat!", list_concat_bang, 1);
+	rb_define_alias(cList, "append_list!", "concat!");
 	rb_define_method(cList, "<<", list_push, 1);
 	rb_define_method(cList, "push", list_push_m, -1);
 	rb_define_method(cList, "pop", list_pop_m, -1);
@@ -2560,9 +6976,18 @@ Init_list(void)
 	rb_define_method(cList, "length", list_length, 0);
 	rb_define_alias(cList, "size", "length");
 	rb_define_method(cList, "empty?", list_empty_p, 0);
+	rb_define_method(cList, "find_index", list_find_index, -1);
 	rb_define_alias(cList, "index", "find_index");
+	rb_define_method(cList, "any?", list_any_p, -1);
+	rb_define_method(cList, "all?", list_all_p, -1);
+	rb_define_method(cList, "none?", list_none_p, -1);
+	rb_define_method(cList, "one?", list_one_p, -1);
+	rb_define_method(cList, "find", list_find, -1);
+	rb_define_alias(cList, "detect", "find");
+	rb_define_method(cList, "each_with_index", list_each_with_index, 0);
 	rb_define_method(cList, "rindex", list_rindex, -1);
 	rb_define_method(cList, "join", list_join_m, -1);
+	rb_define_method(cList, "join_to", list_join_to, -1);
 	rb_define_method(cList, "reverse", list_reverse_m, 0);
 	rb_define_method(cList, "reverse!", list_reverse_bang, 0);
 	rb_define_method(cList, "rotate", list_rotate_m, -1);
@@ -2571,6 +6996,9 @@ Init_list(void)
 	rb_define_method(cList, "sort!", list_sort_bang, 0);
 	rb_define_method(cList, "sort_by", list_sort_by, 0);
 	rb_define_method(cList, "sort_by!", list_sort_by_bang, 0);
+	rb_define_method(cList, "sort_external!", list_sort_external_bang, -1);
+	rb_define_method(cList, "merge", list_merge, 1);
+	rb_define_method(cList, "merge!", list_merge_bang, 1);
 	rb_define_method(cList, "collect", list_collect, 0);
 	rb_define_method(cList, "collect!", list_collect_bang, 0);
 	rb_define_method(cList, "map", list_collect, 0);
@@ -2584,6 +7012,9 @@ Init_list(void)
 	rb_define_method(cList, "delete_if", list_delete_if, 0);
 	rb_define_method(cList, "reject", list_reject, 0);
 	rb_define_method(cList, "reject!", list_reject_bang, 0);
+	rb_define_method(cList, "partition!", list_partition_bang, 0);
+	rb_define_method(cList, "group_by!", list_group_by_bang, 0);
+	rb_define_method(cList, "slice_when!", list_slice_when_bang, 0);
 	rb_define_method(cList, "zip", list_zip, -1);
 	rb_define_method(cList, "transpose", list_transpose, 0);
 	rb_define_method(cList, "replace", list_replace, 1);
@@ -2603,6 +7034,9 @@ Init_list(void)
 	rb_define_method(cList, "-", list_diff, 1);
 	rb_define_method(cList, "&", list_and, 1);
 	rb_define_method(cList, "|", list_or, 1);
+	rb_define_method(cList, "sorted_union", list_sorted_union, 1);
+	rb_define_method(cList, "sorted_intersection", list_sorted_intersection, 1);
+	rb_define_method(cList, "sorted_difference", list_sorted_difference, 1);
 
 	rb_define_method(cList, "uniq", list_uniq, 0);
 	rb_define_method(cList, "uniq!", list_uniq_bang, 0);
@@ -2611,6 +7045,14 @@ Init_list(void)
 	rb_define_method(cList, "flatten", list_flatten, -1);
 	rb_define_method(cList, "flatten!", list_flatten_bang, -1);
 	rb_define_method(cList, "count", list_count, -1);
+	rb_define_method(cList, "min", list_min, -1);
+	rb_define_method(cList, "max", list_max, -1);
+	rb_define_method(cList, "minmax", list_minmax, 0);
+	rb_define_method(cList, "sum", list_sum, -1);
+	rb_define_method(cList, "inject", list_inject, -1);
+	rb_define_method(cList, "reduce", list_inject, -1);
+	rb_define_method(cList, "min_by", list_min_by, -1);
+	rb_define_method(cList, "max_by", list_max_by, -1);
 	rb_define_method(cList, "shuffle", list_shuffle, -1);
 	rb_define_method(cList, "shuffle!", list_shuffle_bang, -1);
 	rb_define_method(cList, "sample", list_sample, -1);
@@ -2639,6 +7081,20 @@ Init_list(void)
 	rb_define_const(cList, "VERSION", rb_str_new2(LIST_VERSION));
 
 	id_cmp = rb_intern("<=>");
+	id_eq = rb_intern("==");
 	id_each = rb_intern("each");
 	id_to_list = rb_intern("to_list");
+	id_call = rb_intern("call");
+	id_next = rb_intern("next");
+	id_size = rb_intern("size");
+	id_lazy = rb_intern("lazy");
+	id_uniq = rb_intern("uniq");
+	id_memory_limit = rb_intern("memory_limit");
+	id_tmpdir = rb_intern("tmpdir");
+	id_eqq = rb_intern("===");
+	id_to_s = rb_intern("to_s");
+	id_write = rb_intern("write");
+
+	rb_gc_register_mark_object(Data_Wrap_Struct(0, vset_mark, 0, &vset_cache));
+	Init_list_sorted();
 }
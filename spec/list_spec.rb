@@ -40,6 +40,61 @@ describe List do
     list = klass.new.to_list
     expect(list).to eq(@cls[])
     expect(list.class).to eq(@cls)
+    expect((0...3).to_list).to eq(@cls[0,1,2])
+    expect((3..0).to_list).to eq(@cls[])
+    expect(('a'..'c').to_list).to eq(@cls['a','b','c'])
+    expect({a: 1, b: 2}.to_list).to eq(@cls[[:a, 1], [:b, 2]])
+    expect(Struct.new(:a, :b).new(1, 2).to_list).to eq(@cls[1, 2])
+    klass = Class.new(Array) { def each; yield 42; end }
+    expect(klass[1,2].to_list).to eq(@cls[42])
+  end
+
+  it "to_list lazy" do
+    list = (1..Float::INFINITY).to_list(lazy: true)
+    expect(list.first(3)).to eq(@cls[1,2,3])
+    expect(list[9]).to eq(10)
+    list = [1,2,3].to_list(lazy: true)
+    expect(list.size).to eq(3)
+    expect(list).to eq(@cls[1,2,3])
+    expect([[1,2],[3]].each_slice(1).to_list(lazy: true)).to eq(@cls[[[1,2]],[[3]]])
+    list = Enumerator.new(5) { |y| y << 1; y << 2 }.to_list(lazy: true)
+    expect(list.size).to eq(2)
+    expect(Enumerator.new(1) { |y| y << 1; y << 2 }.to_list(lazy: true).to_a).to eq([1,2])
+    ary = [1,2,3]
+    list = ary.to_list(lazy: true)
+    ary.pop
+    expect(list.size).to eq(3)
+    expect(list[-1]).to eq(3)
+    expect(list.to_a).to eq([1,2,3])
+    hash = {a: 1, b: 2}
+    list = hash.to_list(lazy: true)
+    hash.delete(:a)
+    expect(list.size).to eq(1)
+    list = (1..Float::INFINITY).to_list(lazy: true)
+    expect(list.size).to eq(Float::INFINITY)
+    expect{list[-1]}.to raise_error(RangeError)
+    expect{list.to_a}.to raise_error(RangeError)
+  end
+
+  it "lazy_new" do
+    called = []
+    list = @cls.lazy_new(1_000_000) { |i| called << i; i * 2 }
+    expect(list.length).to eq(1_000_000)
+    expect(called.size).to eq(0)
+    expect(list[3]).to eq(6)
+    expect(list.first(2)).to eq(@cls[0,2])
+    expect(list.each.first(5)).to eq([0,2,4,6,8])
+    expect(list.take_while { |x| x < 10 }).to eq(@cls[0,2,4,6,8])
+    expect(called).to eq([0,1,2,3,4,5])
+    list = @cls.lazy_new(3) { |i| i }
+    expect(list.push(9)).to eq(@cls[0,1,2,9])
+    expect(@cls.lazy_new(0) { 1 }).to eq(@cls[])
+    expect(@subcls.lazy_new(1) { 1 }).to be_a_kind_of(@subcls)
+    expect{@cls.lazy_new(1)}.to raise_error(LocalJumpError)
+    expect{@cls.lazy_new(-1) {}}.to raise_error(ArgumentError)
+    list = nil
+    list = @cls.lazy_new(2) { |i| list.to_a }
+    expect{list.to_a}.to raise_error(RuntimeError)
   end
 
   it "initialize" do
@@ -105,8 +160,11 @@ describe List do
   it "eql?" do
     list = @cls.new
     expect(list.eql?(list)).to be true
-    expect(list.eql?(@cls.new)).to be false
-    expect(list.eql?(@subcls.new)).to be false
+    expect(list.eql?(@cls.new)).to be true
+    expect(list.eql?(@subcls.new)).to be true
+    expect(@cls[1,"a",[2]].eql?(@cls[1,"a",[2]])).to be true
+    expect(@cls[1].eql?(@cls[1.0])).to be false
+    expect(@cls[1].eql?([1])).to be false
   end
 
   it "hash" do
@@ -117,6 +175,11 @@ describe List do
     hash = {}
     hash[list1] = 1
     expect(hash[list1]).to eq(1)
+    expect(hash[list2]).to eq(1)
+    expect(hash[@cls[1,2,3.0]]).to eq(nil)
+    key = @cls[1,"a",:b].freeze
+    expect(key.hash).to eq(key.hash)
+    expect(key.hash).to eq(@cls[1,"a",:b].hash)
   end
 
   it "[]" do
@@ -178,6 +241,14 @@ describe List do
     a[-1,0] = a
     expect(a).to eq(@cls[1,2,1,2,3,3]);
 
+    a = @cls[1,2,3,4]
+    a[1,1] = @cls[]
+    expect(a).to eq(@cls[1,3,4]);
+    a[1,1] = @cls[5,6]
+    expect(a).to eq(@cls[1,5,6,4]);
+    a << 7
+    expect(a).to eq(@cls[1,5,6,4,7]);
+
     expect{@cls[0][-2] = 1}.to raise_error(IndexError)
     expect{@cls[0][-2,0] = nil}.to raise_error(IndexError)
     expect{@cls[0][0,0,0] = 0}.to raise_error(ArgumentError)
@@ -238,6 +309,39 @@ describe List do
     expect(list.concat(list2)).to eq(@cls[1,2,3])
     expect(list.concat([4,5,6])).to eq(@cls[1,2,3,4,5,6])
     expect(list.concat(@subcls[7,8,9])).to eq(@cls[1,2,3,4,5,6,7,8,9])
+    expect{list.concat(Object.new.method(:to_s))}.to raise_error(TypeError)
+  end
+
+  it "concat!" do
+    list = @cls[1]
+    list2 = @cls[2,3]
+    expect(list.concat!(list2)).to eq(@cls[1,2,3])
+    expect(list2).to eq(@cls[])
+    list2.push 4
+    expect(list2).to eq(@cls[4])
+    expect(list.push(5)).to eq(@cls[1,2,3,5])
+    expect(list.append_list!(@subcls[6])).to eq(@cls[1,2,3,5,6])
+    expect(list.concat!([7])).to eq(@cls[1,2,3,5,6,7])
+    expect(@cls[].concat!(@cls[1])).to eq(@cls[1])
+    expect{list.concat!(list)}.to raise_error(ArgumentError)
+    expect{list.concat!(@cls[1].freeze)}.to raise_error(RuntimeError)
+    meth = Object.new.method(:to_s)
+    expect{list.concat!(meth)}.to raise_error(TypeError)
+    expect(meth.call).to be_a_kind_of(String)
+    expect(@cls[1].concat!([2,3].each)).to eq(@cls[1,2,3])
+  end
+
+  it "concat_all" do
+    lists = [@cls[1], @cls[], @cls[2,3]]
+    expect(@cls.concat_all(lists)).to eq(@cls[1,2,3])
+    expect(lists).to eq([@cls[], @cls[], @cls[]])
+    expect(@subcls.concat_all(@cls[@cls[1]])).to be_a_kind_of(@subcls)
+    expect(@cls.concat_all([])).to eq(@cls[])
+    a = @cls[1,2]
+    expect{@cls.concat_all([a, @cls[3].freeze])}.to raise_error(RuntimeError)
+    expect(a).to eq(@cls[1,2])
+    expect{@cls.concat_all([a, Object.new.method(:to_s)])}.to raise_error(TypeError)
+    expect(a).to eq(@cls[1,2])
   end
 
   it "push" do
@@ -258,6 +362,13 @@ describe List do
     expect(list.pop(2)).to eq(@cls[2,3])
     expect(list.pop).to eq(1)
     expect{list.pop("1")}.to raise_error(TypeError)
+    list.push 1,2,3,4,5
+    expect(list.pop(0)).to eq(@cls[])
+    expect(list.pop(10)).to eq(@cls[1,2,3,4,5])
+    expect(list).to eq(@cls[])
+    list.push 6
+    expect(list).to eq(@cls[6])
+    expect{list.pop(-1)}.to raise_error(ArgumentError)
   end
 
   it "shift" do
@@ -267,6 +378,15 @@ describe List do
     expect(list.shift(2)).to eq(@cls[1,2])
     expect(list.shift).to eq(3)
     expect{list.shift("1")}.to raise_error(TypeError)
+    list.push 1,2,3,4,5
+    expect(list.shift(1)).to eq(@cls[1])
+    expect(list).to eq(@cls[2,3,4,5])
+    expect(list.shift(10)).to eq(@cls[2,3,4,5])
+    expect(list).to eq(@cls[])
+    list.push 6
+    expect(list).to eq(@cls[6])
+    expect{list.shift(-1)}.to raise_error(ArgumentError)
+    expect{@cls[1].freeze.shift}.to raise_error(RuntimeError)
   end
 
   it "unshift" do
@@ -353,6 +473,84 @@ describe List do
     expect(list.find_index(1)).to eq(0)
     expect(list.find_index(2)).to eq(1)
     expect(list.index(3)).to eq(2)
+    expect(list.index(2.0)).to eq(1)
+    expect(list.find_index{|x| 1 < x}).to eq(1)
+  end
+
+  it "any?, all?, none? and one?" do
+    expect(@cls[].any?).to eq false
+    expect(@cls[nil, 1].any?).to eq true
+    expect(@cls[nil, 1].all?).to eq false
+    expect(@cls[1, 2].all?{|i| 0 < i}).to eq true
+    expect(@cls[1, 2.0].all?(Integer)).to eq false
+    expect(@cls[1, 2.0].any?(2)).to eq true
+    expect(@cls["ab", "c"].none?(/b/)).to eq false
+    expect(@cls[1, 2, 3].one?(2..2)).to eq true
+    expect(@cls[1, 2, 3].one?{|i| 1 < i}).to eq false
+    list = (1..Float::INFINITY).to_list(lazy: true)
+    expect(list.any?{|i| 10 < i}).to eq true
+  end
+
+  it "find and each_with_index" do
+    expect(@cls[1, 2, 3].find{|i| 1 < i}).to eq(2)
+    expect(@cls[1, 2, 3].detect{|i| 5 < i}).to eq(nil)
+    expect(@cls[1].find(proc{:none}){false}).to eq(:none)
+    r = []
+    list = @cls[:a, :b]
+    expect(list.each_with_index{|x, i| r << [x, i]}.equal?(list)).to eq true
+    expect(r).to eq([[:a, 0], [:b, 1]])
+    expect(list.each_with_index.size).to eq(2)
+  end
+
+  it "min and max" do
+    expect(@cls[].min).to eq(nil)
+    expect(@cls[3,1,2].min).to eq(1)
+    expect(@cls[3,1,2].max).to eq(3)
+    expect(@cls["b","c","a"].max).to eq("c")
+    expect(@cls[1.5,3,2].max).to eq(3)
+    expect(@cls[3,1,2].min{|a,b| b <=> a}).to eq(3)
+    expect(@cls[3,1,2].max(2)).to eq([3,2])
+    expect(@cls[3,1,2,1].min(3)).to eq([1,1,2])
+    expect(@cls[3,1,2].min(5)).to eq([1,2,3])
+    expect(@cls[3,1,2].max(0)).to eq([])
+    expect(@cls[3,1,2].min(2){|a,b| b <=> a}).to eq([3,2])
+    expect{@cls[1].min(-1)}.to raise_error(ArgumentError)
+    expect{@cls[1,"a"].min}.to raise_error(ArgumentError)
+  end
+
+  it "minmax, sum and inject" do
+    expect(@cls[].minmax).to eq([nil, nil])
+    expect(@cls[3,1,4,1,5].minmax).to eq([1,5])
+    expect(@cls[3,1,2].minmax{|a,b| b <=> a}).to eq([3,1])
+    expect(@cls[].sum).to eq(0)
+    expect(@cls[1,2,3].sum(10)).to eq(16)
+    expect(@cls[2**62, 2**62].sum).to eq(2**63)
+    expect(@cls[0.1]*10).to be_a_kind_of(@cls)
+    expect((@cls[0.1]*10).sum).to eq(1.0)
+    expect(@cls[1, 0.5, 1r/2].sum).to eq(2.0)
+    expect(@cls[1r/3, 1r/3].sum).to eq(2r/3)
+    expect(@cls[1r/2, 1r/2].sum).to be_a_kind_of(Rational)
+    expect(@cls[2**70, 1r/3, -(2**70)].sum(1)).to eq(4r/3)
+    expect(@cls[1, 2].sum(1r/2)).to eq(7r/2)
+    expect(@cls["a","b"].sum("")).to eq("ab")
+    expect(@cls[1,2,3].sum{|i| i * 2}).to eq(12)
+    expect{@cls[1,"a"].sum}.to raise_error(TypeError)
+    expect(@cls[].inject(:+)).to eq(nil)
+    expect(@cls[1,2,3].inject(:+)).to eq(6)
+    expect(@cls[1,2,3].inject(10, :*)).to eq(60)
+    expect(@cls[1.5,2.5].reduce("+")).to eq(4.0)
+    expect(@cls[1,2,3].inject{|m,i| m - i}).to eq(-4)
+    expect(@cls[1,2,3].inject(1){|m,i| m * i}).to eq(6)
+  end
+
+  it "min_by and max_by" do
+    list = @cls["ccc","a","bb","dd"]
+    expect(list.min_by(&:size)).to eq("a")
+    expect(list.max_by(&:size)).to eq("ccc")
+    expect(list.max_by(2, &:size)).to eq(["ccc","bb"])
+    expect(list.min_by(3, &:size)).to eq(["a","bb","dd"])
+    expect(@cls[].min_by(&:size)).to eq(nil)
+    expect(list.min_by.size).to eq(4)
   end
 
   it "replace" do
@@ -407,6 +605,30 @@ describe List do
     expect{@cls[a].join}.to raise_error(ArgumentError)
   end
 
+  it "join with numbers, symbols and nesting" do
+    expect(@cls[-12, 0, 2**70, :a, nil, 1.5].join(",")).to eq("-12,0,#{2**70},a,,1.5")
+    expect(@cls[1, [2, @cls[:c, [3]]], "d"].join("-")).to eq("1-2-c-3-d")
+    expect(@cls["\u00fc", 1].join.encoding).to eq(Encoding::UTF_8)
+    expect(@cls[1, :a].join.encoding).to eq(Encoding::US_ASCII)
+    a = [1]
+    a << a
+    expect{@cls[a].join}.to raise_error(ArgumentError)
+  end
+
+  it "join_to" do
+    buf = "x:"
+    expect(@cls[1, :b, "c"].join_to(buf, "-").equal?(buf)).to eq true
+    expect(buf).to eq("x:1-b-c")
+    list = @cls[*1..5000]
+    io = Object.new
+    def io.out; @out ||= ""; end
+    def io.write(s); out << s; s.bytesize; end
+    expect(list.join_to(io, ",").equal?(io)).to eq true
+    expect(io.out).to eq(list.join(","))
+    expect{@cls[1].join_to(Object.new)}.to raise_error(TypeError)
+    expect{@cls[1].join_to("".freeze)}.to raise_error(RuntimeError)
+  end
+
   it "reverse" do
     list = @cls.new
     expect(list.reverse).to eq(@cls.new)
@@ -421,6 +643,9 @@ describe List do
     list.push 1,2,3
     expect(list.reverse!).to eq(@cls[3,2,1])
     expect(list).to eq(@cls[3,2,1])
+    expect(list.push(0)).to eq(@cls[3,2,1,0])
+    expect(list.reverse.push(4)).to eq(@cls[0,1,2,3,4])
+    expect{@cls[1].freeze.reverse!}.to raise_error(RuntimeError)
   end
 
   it "rotate" do
@@ -464,6 +689,12 @@ describe List do
     expect(list).to eq(@cls[1,2,3,4,5])
     expect(list.sort!{|a,b| b - a}).to eq(@cls[5,4,3,2,1])
     expect(list).to eq(@cls[5,4,3,2,1])
+    list = @cls[[1,:a],[0,:b],[1,:c],[0,:d]]
+    expect(list.sort!{|a,b| a[0] <=> b[0]}).to eq(@cls[[0,:b],[0,:d],[1,:a],[1,:c]])
+    list = @cls[3,1,:x,2]
+    expect{list.sort!}.to raise_error(ArgumentError)
+    expect(list.size).to eq(4)
+    expect{@cls[2,1].freeze.sort!}.to raise_error(RuntimeError)
   end
 
   it "sort_by" do
@@ -473,6 +704,10 @@ describe List do
     expect(list.sort_by{|a| a}).to eq(@cls[1,2,3,4,5])
     expect(list.sort_by{|a| -a}).to eq(@cls[5,4,3,2,1])
     expect(list).to eq(@cls[4,1,3,5,2])
+    a = (0...200).map { |i| [(i * 37) % 11 - 5, i] }
+    expect(a.to_list.sort_by{|k,i| k}.to_a).to eq(a.sort_by{|k,i| [k, i]})
+    expect(a.to_list.sort_by{|k,i| k * 0.5}.to_a).to eq(a.sort_by{|k,i| [k, i]})
+    expect(a.to_list.sort_by{|k,i| k.odd? ? k : k.to_f}.to_a).to eq(a.sort_by{|k,i| [k, i]})
   end
 
   it "sort_by!" do
@@ -482,6 +717,93 @@ describe List do
     expect(list.sort_by!{|a| a}).to eq(@cls[1,2,3,4,5])
     expect(list.sort_by!{|a| -a}).to eq(@cls[5,4,3,2,1])
     expect(list).to eq(@cls[5,4,3,2,1])
+    list = @cls[[1,:a],[0,:b],[1,:c],[0,:d]]
+    expect(list.sort_by!{|a| a[0]}).to eq(@cls[[0,:b],[0,:d],[1,:a],[1,:c]])
+    expect{list.sort_by!{|a| raise "x" if a[0] == 1; a}}.to raise_error(RuntimeError)
+    expect(list.size).to eq(4)
+    expect(list.last).to eq(list.to_a.last)
+  end
+
+  it "sort_external!" do
+    expect(@cls.new.sort_external!).to eq(@cls.new)
+    a = (1..3000).map { |i| (i * 7919) % 1009 }
+    list = @cls[*a]
+    expect(list.sort_external!(memory_limit: 1024)).to eq(@cls[*a.sort])
+    list = @cls[*a.map { |i| [i % 5, i.to_s] }]
+    list.sort_external!(memory_limit: 1024) { |x, y| x[0] <=> y[0] }
+    expect(list.to_a).to eq(a.map { |i| [i % 5, i.to_s] }.sort_by.with_index { |x, i| [x[0], i] })
+    list = @cls[*a, "x", *a]
+    expect{list.sort_external!(memory_limit: 256)}.to raise_error(ArgumentError)
+    expect(list.size).to eq(6001)
+    expect(list.to_a.sort_by(&:to_s)).to eq([*a, "x", *a].sort_by(&:to_s))
+    k = Struct.new(:v, :pr) do
+      include Comparable
+      def <=>(o); v <=> o.v; end
+    end
+    list = @cls[k.new(2, proc {}), k.new(1, proc {})]
+    expect(list.sort_external!.map(&:v)).to eq(@cls[1, 2])
+  end
+
+  it "merge and merge!" do
+    list = @cls[1,3,5]
+    expect(list.merge(@cls[2,3,4])).to eq(@cls[1,2,3,3,4,5])
+    expect(list.merge([0,6])).to eq(@cls[0,1,3,5,6])
+    expect(list).to eq(@cls[1,3,5])
+    a = @cls[[1,:a],[2,:a]]
+    b = @cls[[1,:b],[3,:b]]
+    expect(a.merge!(b){|x| x[0]}).to eq(@cls[[1,:a],[1,:b],[2,:a],[3,:b]])
+    expect(b).to eq(@cls[])
+    expect(a.size).to eq(4)
+    expect{a.merge!(a)}.to raise_error(ArgumentError)
+    expect{a.merge!(Object.new.method(:to_s))}.to raise_error(TypeError)
+    a = @cls[1,3,5]
+    b = @cls[2,"x",4]
+    expect{a.merge!(b)}.to raise_error(ArgumentError)
+    expect(a).to eq(@cls[1,2,3,5])
+    expect(b).to eq(@cls["x",4])
+    a = @cls[3,5]
+    b = @cls["x",4]
+    expect{a.merge!(b)}.to raise_error(ArgumentError)
+    expect(a).to eq(@cls[3,5])
+    expect(b).to eq(@cls["x",4])
+    a = @cls[1,3]
+    b = @cls[2,4]
+    expect{a.merge!(b) { |i| raise if i == 4; i }}.to raise_error(RuntimeError)
+    expect(a).to eq(@cls[1,3])
+    expect(b).to eq(@cls[2,4])
+  end
+
+  it "merge_all" do
+    lists = [@cls[1,4,7], @cls[], [2,5,8], @cls[3,3,6]]
+    expect(@cls.merge_all(lists)).to eq(@cls[1,2,3,3,4,5,6,7,8])
+    expect(@cls.merge_all(lists, uniq: true)).to eq(@cls[1,2,3,4,5,6,7,8])
+    expect(@cls.merge_all([@cls[3,1], @cls[2]]){|x| -x}).to eq(@cls[3,2,1])
+    expect(@cls.merge_all([])).to eq(@cls[])
+    expect(lists[0]).to eq(@cls[1,4,7])
+    a = @cls[1,3]
+    expect(@cls.merge_all([a, a])).to eq(@cls[1,1,3,3])
+    expect(a).to eq(@cls[1,3])
+    a = @cls[1,3,5]
+    b = @cls[2,4,6]
+    merged = @cls.merge_all([a, b]) { |x| a.clear; b.clear; GC.start; @cls["x"] * 10; x }
+    expect(merged).to eq(@cls[1,2,3,4,5,6])
+    expect(a).to eq(@cls[1,3,5])
+    expect(b).to eq(@cls[2,4,6])
+    expect{@cls.merge_all([a, b]) { |x| raise if x == 4; x }}.to raise_error(RuntimeError)
+    expect(a).to eq(@cls[1,3,5])
+    expect(@cls.merge_all([@cls[1,3].freeze, b])).to eq(@cls[1,2,3,4,6])
+    expect{@cls.merge_all([a, Object.new.method(:to_s)])}.to raise_error(TypeError)
+  end
+
+  it "sorted set operations" do
+    a = @cls[1,1,2,4,6]
+    b = @cls[2,3,4,4]
+    expect(a.sorted_union(b)).to eq(@cls[1,2,3,4,6])
+    expect(a.sorted_intersection(b)).to eq(@cls[2,4])
+    expect(a.sorted_difference(b)).to eq(@cls[1,6])
+    expect(a.sorted_union([0])).to eq(@cls[0,1,2,4,6])
+    expect(@cls[].sorted_difference(b)).to eq(@cls[])
+    expect(a).to eq(@cls[1,1,2,4,6])
   end
 
   it "collect" do
@@ -518,6 +840,17 @@ describe List do
     expect(list.select!.each{|i| i % 4 == 0}).to eq(@cls[4])
     expect(list.select!.each{|i| i % 4 == 0}).to eq(nil)
     expect(list).to eq(@cls[4])
+    list = @cls[1,2,3]
+    expect(list.select!{|i| i < 3}).to eq(@cls[1,2])
+    expect(list.push(4)).to eq(@cls[1,2,4])
+    list = @cls[1,2]
+    expect{list.select!{|i| list.freeze; false}}.to raise_error(RuntimeError)
+    list = @cls[*1..6]
+    expect{list.select!{|i| list.shift if i == 2; i.odd?}}.to raise_error(RuntimeError)
+    expect(list).to eq(@cls[1,3,4,5,6])
+    list = @cls[*1..6]
+    list.select!{|i| break if i == 4; i.odd?}
+    expect(list).to eq(@cls[1,3,4,5,6])
   end
 
   it "keep_if" do
@@ -599,6 +932,52 @@ describe List do
     expect(list).to eq(@cls[])
   end
 
+  it "partition!" do
+    list = @cls[1,2,3,4,5]
+    odd, even = list.partition! { |i| i.odd? }
+    expect(odd).to eq(@cls[1,3,5])
+    expect(even).to eq(@cls[2,4])
+    expect(list).to eq(@cls[])
+    expect(odd.push(7)).to eq(@cls[1,3,5,7])
+    expect(list.push(1)).to eq(@cls[1])
+    expect(@cls[1].partition!.each { true }).to eq([@cls[1], @cls[]])
+    list = @cls[1,2]
+    expect{list.partition! { list.shift }}.to raise_error(RuntimeError)
+    expect{@cls[1].freeze.partition! { true }}.to raise_error(RuntimeError)
+    list = @cls[1,2,3,4,5]
+    expect(list.partition! { |i| break :stop if i == 4; i.odd? }).to eq(:stop)
+    expect(list).to eq(@cls[1,3,2,4,5])
+    list = @cls[1,2,3]
+    expect{list.partition! { |i| raise if i == 3; i.odd? }}.to raise_error(RuntimeError)
+    expect(list).to eq(@cls[1,2,3])
+  end
+
+  it "group_by!" do
+    list = @cls[1,2,3,4,5]
+    expect(list.group_by! { |i| i % 3 }).to eq({1 => @cls[1,4], 2 => @cls[2,5], 0 => @cls[3]})
+    expect(list).to eq(@cls[])
+    list = @cls[1,2,3]
+    expect{list.group_by! { |i| raise if i == 2; i }}.to raise_error(RuntimeError)
+    expect(list).to eq(@cls[1,2,3])
+    list = @cls[1,2,3,4,5]
+    expect(list.group_by! { |i| break :stop if i == 4; i % 2 }).to eq(:stop)
+    expect(list).to eq(@cls[1,3,2,4,5])
+  end
+
+  it "slice_when!" do
+    list = @cls[1,2,4,9,10,11,12,15]
+    expect(list.slice_when! { |i, j| i + 1 != j }).to eq([@cls[1,2], @cls[4], @cls[9,10,11,12], @cls[15]])
+    expect(list).to eq(@cls[])
+    expect(@cls[].slice_when! { true }).to eq([])
+    expect{@cls[1].slice_when!}.to raise_error(LocalJumpError)
+    list = @cls[1,2,4,5,6]
+    expect(list.slice_when! { |i, j| break :stop if j == 5; i + 1 != j }).to eq(:stop)
+    expect(list).to eq(@cls[1,2,4,5,6])
+    list = @cls[1,2,4,5,6]
+    expect{list.slice_when! { |i, j| raise if j == 6; false }}.to raise_error(RuntimeError)
+    expect(list).to eq(@cls[1,2,4,5,6])
+  end
+
   it "zip" do
     a = @cls[4,5,6]
     b = @cls[7,8,9]
@@ -610,6 +989,15 @@ describe List do
     expect(a.zip([1,2],[8])).to eq(@cls[[4,1,8],[5,2,nil],[6,nil,nil]])
     expect(a.zip([1,2],[8]){|i| ary << i}).to eq(nil)
     expect(ary).to eq([[4,1,8],[5,2,nil],[6,nil,nil]])
+    list = @cls[1,2,3,4]
+    ary = []
+    list.zip([5,6,7,8]) { |i| ary << i; list.clear; @cls[*100..200] }
+    expect(ary).to eq([[1,5],[2,6],[3,7],[4,8]])
+    other = @cls[5,6,7,8]
+    ary = []
+    @cls[1,2,3,4].zip(other) { |i| ary << i; other.clear; @cls[*100..200] }
+    expect(ary).to eq([[1,5],[2,6],[3,7],[4,8]])
+    expect(a.zip(1..Float::INFINITY, (7..8).each)).to eq(@cls[[4,1,7],[5,2,8],[6,3,nil]])
     expect{a.zip("a")}.to raise_error(TypeError)
 
     obj = Object.new
@@ -645,6 +1033,7 @@ describe List do
     expect(list.fill{|i| i*i}).to eq(@cls[0,1,4,9])
     expect(list.fill(-2){|i| i*i*i}).to eq(@cls[0,1,8,27])
     expect(list.fill("z",2)).to eq(@cls[0,1,"z","z"])
+    expect(list.fill("w",3,3)).to eq(@cls[0,1,"z","w","w","w"])
     expect{list.fill("z","a")}.to raise_error(TypeError)
   end
 
@@ -689,6 +1078,9 @@ describe List do
     expect{list.slice!(1,"a")}.to raise_error(TypeError)
     expect{list.slice!(1,2,3)}.to raise_error(ArgumentError)
     expect(list).to eq(@cls[1,2,3,4])
+    expect(list.slice!(1,2)).to eq(@cls[2,3])
+    list.push 5
+    expect(list).to eq(@cls[1,4,5])
   end
 
   it "assoc" do
@@ -761,7 +1153,7 @@ describe List do
     b = @cls[*%w{a b c d e}]
     c = a | b
     expect(b).to eq(c)
-    expect(b.eql?(c)).to eq false
+    expect(b.equal?(c)).to eq false
   end
 
   it "uniq" do
@@ -769,25 +1161,25 @@ describe List do
     b = a.uniq
     expect(a).to eq(@cls[])
     expect(b).to eq(@cls[])
-    expect(a.eql?(b)).to eq false
+    expect(a.equal?(b)).to eq false
 
     a = @cls[1]
     b = a.uniq
     expect(a).to eq(@cls[1])
     expect(b).to eq(@cls[1])
-    expect(a.eql?(b)).to eq false
+    expect(a.equal?(b)).to eq false
 
     a = @cls[1,1]
     b = a.uniq
     expect(a).to eq(@cls[1,1])
     expect(b).to eq(@cls[1])
-    expect(a.eql?(b)).to eq false
+    expect(a.equal?(b)).to eq false
 
     a = @cls[1,2]
     b = a.uniq
     expect(a).to eq(@cls[1,2])
     expect(b).to eq(@cls[1,2])
-    expect(a.eql?(b)).to eq false
+    expect(a.equal?(b)).to eq false
 
     a = @cls[1,2,3,2,1,2,3,4,nil]
     b = a.dup
@@ -799,6 +1191,12 @@ describe List do
     expect(c.uniq{|s| s[/^\w+/]}).to eq(@cls["a:def","b:abc","c:jkl"])
     expect(c).to eq(d)
 
+    a = @cls[1, 1.0, 0.0, -0.0, 2**70, 2**70, "a", "a".b, [1], [1], :a]
+    expect(a.uniq.to_a).to eq([1, 1.0, 0.0, 2**70, "a", [1], :a])
+    expect((a | @cls[2, 1]).to_a).to eq([1, 1.0, 0.0, 2**70, "a", [1], :a, 2])
+    expect((a & @cls[-0.0, [1]]).to_a).to eq([0.0, [1]])
+    expect((a - @cls[0.0, "a"]).to_a).to eq([1, 1.0, 2**70, 2**70, [1], [1], :a])
+
     a = @cls[*%w{a a}]
     b = a.uniq
     expect(a).to eq(@cls[*%w{a a}])
@@ -815,19 +1213,19 @@ describe List do
     b = a.uniq {|v| v.even? }
     expect(a).to eq(@cls[])
     expect(b).to eq(@cls[])
-    expect(a.eql?(b)).to eq false
+    expect(a.equal?(b)).to eq false
 
     a = @cls[1]
     b = a.uniq {|v| v.even? }
     expect(a).to eq(@cls[1])
     expect(b).to eq(@cls[1])
-    expect(a.eql?(b)).to eq false
+    expect(a.equal?(b)).to eq false
 
     a = @cls[1,3]
     b = a.uniq {|v| v.even? }
     expect(a).to eq(@cls[1,3])
     expect(b).to eq(@cls[1])
-    expect(a.eql?(b)).to eq false
+    expect(a.equal?(b)).to eq false
 
     a = @cls[*%w{a a}]
     b = a.uniq {|v| v }
@@ -895,12 +1293,12 @@ describe List do
     b = a.uniq! {|v| v.even? }
     expect(a).to eq(@cls[1])
     expect(b).to eq(@cls[1])
-    expect(a.eql?(b)).to eq true
+    expect(a.equal?(b)).to eq true
 
     a = @cls[*%w{a a}]
     b = a.uniq! {|v| v }
     expect(b).to eq(@cls[*%w{a}])
-    expect(a.eql?(b)).to eq true
+    expect(a.equal?(b)).to eq true
     expect(b.none?(&:frozen?)).to eq true
 
     list = @cls[1,2]
@@ -929,6 +1327,7 @@ describe List do
     a = @cls[1,nil,nil,2,3,nil,4,nil]
     expect(a.compact!).to eq(@cls[1,2,3,4])
     expect(a).to eq(@cls[1,2,3,4])
+    expect(a.push(5)).to eq(@cls[1,2,3,4,5])
 
     a = @cls[1,2,3,4]
     expect(a.compact!).to eq(nil)
@@ -959,7 +1358,7 @@ describe List do
     a8 = @cls[@cls[1,2],3]
     a9 = a8.flatten(0)
     expect(a9).to eq(a8)
-    expect(a9.eql?(a8)).to eq false
+    expect(a9.equal?(a8)).to eq false
 
     f = [].freeze
     expect{f.flatten!(1,2)}.to raise_error(ArgumentError)
@@ -984,6 +1383,15 @@ describe List do
     expect(@cls[@cls[@cls[@cls[],@cls[]],@cls[@cls[]],@cls[]],@cls[@cls[@cls[]]]].flatten!).to eq(@cls[])
 
     expect(@cls[].flatten!(0)).to eq(nil)
+
+    a6 = @cls[1,[2,@cls[3,[4]]],5]
+    expect(a6.flatten!(2)).to eq(@cls[1,2,3,[4],5])
+    expect(a6.size).to eq(5)
+    expect(a6.last).to eq(5)
+    a7 = @cls[1]
+    a7 << [a7]
+    expect{a7.flatten!}.to raise_error(ArgumentError)
+    expect(a7.size).to eq(2)
   end
 
   it "count" do
@@ -1026,6 +1434,17 @@ describe List do
     end
     expect{@cls[*0..2].shuffle(random: gen)}.to raise_error(RangeError)
 
+    list = @cls[*0...100]
+    expect(list.shuffle!(random: Random.new(1)).equal?(list)).to eq true
+    expect(list.to_a).to eq((0...100).to_a.shuffle(random: Random.new(1)))
+    expect(list.last).to eq(list.to_a.last)
+
+    gen = Object.new
+    def gen.rand(*); raise ArgumentError; end
+    list = @cls[1,2,3]
+    expect{list.shuffle!(random: gen)}.to raise_error(ArgumentError)
+    expect(list).to eq(@cls[1,2,3])
+
     # FIXME
     # list = @cls[*(0...10000)]
     # gen = proc do
@@ -1122,12 +1541,19 @@ describe List do
     expect(a.permutation(0).to_list).to eq(@cls[[]])
     expect(a.permutation(1).to_list.sort).to eq(@cls[[1],[2],[3]])
     expect(a.permutation(2).to_list.sort).to eq(@cls[[1,2],[1,3],[2,1],[2,3],[3,1],[3,2]])
+    expect(a.permutation.size).to eq(6)
+    expect(@cls[*1..30].permutation(30).size).to eq((1..30).inject(:*))
+    r = []
+    expect(a.permutation(2) {|x| r << x}.equal?(a)).to eq true
+    expect(r).to eq([1,2,3].permutation(2).to_a)
   end
 
   it "compatible" do
     expect(@cls[1,2,3,4].combination(0).to_list).to eq(@cls[[]])
     expect(@cls[1,2,3,4].combination(1).to_list).to eq(@cls[[1],[2],[3],[4]])
     expect(@cls[1,2,3,4].combination(2).to_list).to eq(@cls[[1,2],[1,3],[1,4],[2,3],[2,4],[3,4]])
+    expect(@cls[*1..40].combination(20).size).to eq(137846528820)
+    expect(@cls[*1..40].combination(20).first(2)).to eq([[*1..20], [*1..19, 21]])
   end
 
   it "repeated_combination" do
@@ -1135,6 +1561,7 @@ describe List do
     expect(a.repeated_combination(0).to_list).to eq(@cls[[]])
     expect(a.repeated_combination(1).to_list.sort).to eq(@cls[[1],[2],[3]])
     expect(a.repeated_combination(2).to_list.sort).to eq(@cls[[1,1],[1,2],[1,3],[2,2],[2,3],[3,3]])
+    expect(a.repeated_combination(4).size).to eq(15)
   end
 
   it "repeated_permutation" do
@@ -1142,12 +1569,16 @@ describe List do
     expect(a.repeated_permutation(0).to_list).to eq(@cls[[]])
     expect(a.repeated_permutation(1).to_list.sort).to eq(@cls[[1],[2]])
     expect(a.repeated_permutation(2).to_list.sort).to eq(@cls[[1,1],[1,2],[2,1],[2,2]])
+    expect(a.repeated_permutation(70).size).to eq(2**70)
   end
 
   it "product" do
     expect(@cls[1,2,3].product([4,5])).to eq(@cls[[1,4],[1,5],[2,4],[2,5],[3,4],[3,5]])
     expect(@cls[1,2].product([1,2])).to eq(@cls[[1,1],[1,2],[2,1],[2,2]])
     expect(@subcls[1,2].product([1,2])).to eq(@subcls[[1,1],[1,2],[2,1],[2,2]])
+    r = []
+    expect(@cls[1,2].product(@cls[3], [4,5]) {|x| r << x}).to eq(@cls[1,2])
+    expect(r).to eq([[1,3,4],[1,3,5],[2,3,4],[2,3,5]])
   end
 
   it "take" do
@@ -1223,4 +1654,47 @@ describe List do
   it "pack" do
     expect(@cls[76,105,115,116].pack("C*")).to eq("List")
   end
+
+  it "Sorted add and delete" do
+    list = List::Sorted[5,1,3]
+    expect(list).to eq(@cls[1,3,5])
+    expect(list.add(4)).to eq(@cls[1,3,4,5])
+    list << 0 << 3
+    expect(list).to eq(@cls[0,1,3,3,4,5])
+    expect(list.last).to eq(5)
+    expect(list.delete(3)).to eq(3)
+    expect(list.delete(3)).to eq(nil)
+    expect(list).to eq(@cls[0,1,4,5])
+    expect(list.size).to eq(4)
+    expect{list.push(1)}.to raise_error(NoMethodError)
+    expect{list.merge!(@cls[2]){|x| -x}}.to raise_error(NoMethodError)
+    expect{List::Sorted.concat_all([@cls[3,1], @cls[2]])}.to raise_error(NoMethodError)
+    expect{List::Sorted.merge_all([@cls[3,1]])}.to raise_error(NoMethodError)
+    expect{List::Sorted.lazy_new(3) { |i| -i }}.to raise_error(NoMethodError)
+    expect(List::Sorted[1.0, 2].delete(1).eql?(1.0)).to eq true
+    hook = nil
+    k = Struct.new(:v) do
+      include Comparable
+      define_method(:<=>) { |o| hook.call if hook; v <=> o.v }
+    end
+    list2 = List::Sorted[*(1..20).map { |i| k.new(i) }]
+    hook = proc { list2.shift }
+    expect{list2.add(k.new(10))}.to raise_error(RuntimeError)
+    expect{list2.delete(k.new(10))}.to raise_error(RuntimeError)
+    expect{list.freeze.add(1)}.to raise_error(RuntimeError)
+  end
+
+  it "Sorted queries" do
+    list = List::Sorted.new((1..100).map { |i| i * 2 })
+    expect(list.include?(50)).to eq(true)
+    expect(list.include?(51)).to eq(false)
+    expect(list.rank(51)).to eq(25)
+    expect(list.between(10, 17)).to eq(@cls[10,12,14,16])
+    expect(list.bsearch { |x| 51 <= x }).to eq(52)
+    expect(list.bsearch { |x| 60 <=> x }).to eq(60)
+    expect(list.first).to eq(2)
+    list.shift
+    expect(list.rank(51)).to eq(24)
+    expect(list.map { |x| -x }.class).to eq(List)
+  end
 end
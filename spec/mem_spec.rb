@@ -6,4 +6,17 @@ describe List do
     GC.start
     expect(list.length).to eq(3000)
   end
+
+  it "keeps contents across item block churn" do
+    10.times do
+      list = List.new(100_000, 0) * 2
+      list.reject! { |i| true }
+      list.concat!(List.new(50_000, 1))
+      expect(list.shift(25_000).length).to eq(25_000)
+      expect(list.length).to eq(25_000)
+      expect(list.all? { |i| i == 1 }).to eq(true)
+    end
+    GC.start
+    expect((List.new(3, 1) + List[2]).to_a).to eq([1,1,1,2])
+  end
 end